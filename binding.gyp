@@ -29,7 +29,11 @@
                    'src/node_ls2_call.cpp',
                    'src/node_ls2_error_wrapper.cpp',
                    'src/node_ls2_handle.cpp',
+                   'src/node_ls2_histogram.cpp',
                    'src/node_ls2_message.cpp',
+                   'src/node_ls2_publisher.cpp',
+                   'src/node_ls2_timer_wheel.cpp',
+                   'src/node_ls2_retry_policy.cpp',
                    'src/node_ls2_utils.cpp' ],
       'link_settings': {
           'libraries': [
@@ -21,84 +21,215 @@
 #include <v8.h>
 #include <uv.h>
 #include <list>
-#include <map>
+#include <vector>
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
 //#include <nan.h>
 
+#include "node_ls2.h"
 #include "node_ls2_call.h"
 #include "node_ls2_handle.h"
+#include "node_ls2_histogram.h"
 #include "node_ls2_message.h"
-
-GMainLoop* gMainLoop = 0;
+#include "node_ls2_message_queue.h"
+#include "node_ls2_utils.h"
 
 using namespace v8;
 using namespace node;
 using namespace std;
 
-typedef std::map<int, uv_poll_t *> WatcherMap;
-typedef std::multimap<int, GPollFD *> PollfdMap;
-typedef std::map<int, int> EventMap;
+#undef VERBOSE_LOGGING
+
+// libuv does not support more than one watcher on same fd, so all GPollFDs
+// for an fd share one FdWatcher
+struct FdWatcher {
+    uv_poll_t poll;
+    struct econtext* ctx;
+    int fd;
+    int mask;            // uv events the watcher was last started with
+    bool armed;          // started, and not yet stopped by poll_cb
+    int pendingMask;     // uv events accumulated in the current prepare cycle
+    int firstPfd;        // index of the first GPollFD for fd, -1 once poll_cb ran
+    unsigned generation; // prepare cycle that last saw fd
+};
+
+// How check_cb holds off querying the glib main context again
+enum LoopPolicyMode {
+    kPolicyImmediate,   // query on every loop iteration, never arm timeout_handle
+    kPolicyFixed,       // hold off for minInterval ms after every check
+    kPolicyAdaptive     // minInterval after a dispatch, doubling up to maxInterval while idle
+};
 
+struct LoopPolicy {
+    LoopPolicyMode mode;
+    unsigned interval;        // ms the next hold-off lasts, 0 for none
+    unsigned minInterval;
+    unsigned maxInterval;
+
+    uint64_t checks;          // check cycles
+    uint64_t dispatches;      // check cycles that dispatched
+    uint64_t skippedPrepares; // prepare cycles skipped during a hold-off
+    uint64_t timerWakeups;    // expirations of timeout_handle
+};
+
+static const char* const policyModeNames[] = { "immediate", "fixed", "adaptive" };
+
+// Bridge instrumentation reported by getLoopStats(). Times are in microseconds.
+struct LoopStats {
+    uint64_t prepares;         // prepare cycles that queried the context
+    uint64_t messages;         // messages delivered to Handle and Call objects
+    LS2Histogram fdsPolled;    // GPollFDs per prepare cycle
+    LS2Histogram dispatchTime; // wall time of g_main_context_dispatch
+    LS2Histogram messagesPerDispatch;
+    LS2Histogram holdoffDelay; // upper bound on how long a hold-off kept a ready fd waiting
+
+    uint64_t holdoffStart;     // uv_hrtime() when the current hold-off began
+    uint64_t resumedFrom;      // holdoffStart of the hold-off the current cycle ended, or 0
+    uint64_t deferred;         // messages carried over to a later iteration by the budget
+};
+
+// How many messages a single dispatch (or drain of the queue) may deliver to JS
+// before the rest is carried over to the next loop iteration. 0 means no limit.
+struct DispatchBudget {
+    unsigned maxMessages;
+    uint64_t maxTime;          // in nanoseconds
+
+    unsigned used;             // messages delivered in the current dispatch
+    uint64_t start;            // uv_hrtime() when the current dispatch began
+};
+
+// The bridge between the libuv loop of one Node.js environment (the main thread
+// or a worker) and the glib main context its LS2 handles are attached to.
 struct econtext {
     GPollFD* pfd; // GpollFD objects from Glib
     int nfd, afd; // number of GpollFD objects, allocated number of objects (rounded up to 2^n)
     gint maxpri;
 
+    uv_loop_t* loop;
     uv_prepare_t pw;
     uv_check_t cw;
     uv_timer_t tw;   // timeout to prevent libuv from running event loop "too soon"
 
     GMainContext* gc;
+    GMainLoop* mainLoop;
+
+    // fd-indexed table of watchers
+    std::vector<FdWatcher*> watchers;
+    // fds seen in the last prepare cycle, and the ones being collected now
+    std::vector<int> activeFds;
+    std::vector<int> nextActiveFds;
+    // index of the next GPollFD with the same fd, or -1
+    std::vector<int> pfdNext;
+    unsigned generation;
+
+    uv_timer_t timeout_handle;
+    bool query;
+    LoopPolicy policy;
+    LoopStats stats;
+    DispatchBudget budget;
+
+    // Bus thread mode: the context is iterated on busThread, and messages it
+    // dispatches are handed to the JS thread through queue and aw.
+    GThread* busThread;
+    std::atomic<bool> busThreadStop;
+    MessageQueue queue;
+    std::atomic<int> queued;   // messages in queue
+    uv_async_t aw;
+    // Serializes dispatch on the bus thread against teardown on the JS thread
+    std::mutex busMutex;
+
+    // uv_poll_t watchers not yet closed, and the other uv handles still to
+    // be closed during environment cleanup
+    int openWatchers;
+    int pendingCloses;
+
+    // Environment teardown: the hook, and node's callback for when the
+    // handles above are all closed
+    node::AsyncCleanupHookHandle cleanupHook;
+    void (*cleanupDone)(void*);
+    void* cleanupDoneArg;
 };
 
-struct PollData {
-    int fd;
-};
+static void finish_cleanup(struct econtext* ctx);
 
-// a map of fds to GPollFDs
-static PollfdMap pfdMap;
+// The bridge of the environment running on this thread
+static thread_local struct econtext* tContext = 0;
+static thread_local bool tOnBusThread = false;
 
-// a map of fds to uv_poll_t
-static WatcherMap pollwMap;
+static void timeout_cb(uv_timer_t* w)
+{
+    /* nop */
+}
 
-#undef VERBOSE_LOGGING
+void RecordDeliveredMessage()
+{
+    tContext->stats.messages++;
+    tContext->budget.used++;
+}
 
-static uv_timer_t timeout_handle;
-static bool query = false;
+static void begin_budget(struct econtext* ctx)
+{
+    ctx->budget.used = 0;
+    if (ctx->budget.maxTime) {
+        ctx->budget.start = uv_hrtime();
+    }
+}
 
-static void timeout_cb(uv_timer_t* w)
+static bool budget_exhausted(struct econtext* ctx)
 {
-    /* nop */
+    const DispatchBudget& b = ctx->budget;
+    return (b.maxMessages && b.used >= b.maxMessages)
+        || (b.maxTime && uv_hrtime() - b.start >= b.maxTime);
+}
+
+bool DeferDelivery(struct econtext* ctx)
+{
+    // Once anything is queued, later messages queue up behind it to keep order
+    if (ctx->queued.load() > 0 || budget_exhausted(ctx)) {
+        ctx->stats.deferred++;
+        return true;
+    }
+    return false;
 }
 
 static void uv_timeout_cb(uv_timer_t *handle)
 {
-    query = true;
-    uv_timer_stop(&timeout_handle);
+    struct econtext* ctx = (struct econtext*) handle->data;
+    ctx->policy.timerWakeups++;
+    ctx->query = true;
+    uv_timer_stop(&ctx->timeout_handle);
 }
 
 // Cleanup memory after poll handle is closed
 static void close_cb(uv_handle_t* handle)
 {
-    uv_poll_t* pollw = (uv_poll_t*) handle;
-
-    PollData *data = (PollData *)pollw->data;
-    delete data;
-    delete pollw;
+    FdWatcher* w = (FdWatcher*) handle->data;
+    struct econtext* ctx = w->ctx;
+    ctx->openWatchers--;
+    delete w;
+    finish_cleanup(ctx);
 }
 
 static void poll_cb(uv_poll_t* handle, int status, int events)
 {
-    PollData *data = (PollData *) handle->data;
-    int fd = data->fd;
+    FdWatcher *w = (FdWatcher *) handle->data;
+    struct econtext* ctx = w->ctx;
     #ifdef VERBOSE_LOGGING
-        std::cerr << "poll_cb, fd: " << fd << "events: " << events << std::endl;
+        std::cerr << "poll_cb, fd: " << w->fd << "events: " << events << std::endl;
     #endif
+    // An fd that is ready as soon as it is polled again after a hold-off may
+    // have been ready for as long as the hold-off lasted
+    if (ctx->stats.resumedFrom) {
+        ctx->stats.holdoffDelay.Record((uv_hrtime() - ctx->stats.resumedFrom) / 1000);
+        ctx->stats.resumedFrom = 0;
+    }
     // Iterate over *all* GPollFDs matching the watcher's fd
-    std::pair <PollfdMap::iterator, PollfdMap::iterator> ret;
-    ret = pfdMap.equal_range(fd);
-    for (PollfdMap::iterator it=ret.first; it!=ret.second; ++it) {
-        GPollFD *pfd = it->second;
+    for (int i = w->firstPfd; i >= 0; i = ctx->pfdNext[i]) {
+        GPollFD *pfd = ctx->pfd + i;
         pfd->revents |= pfd->events & ((events & UV_READABLE ? G_IO_IN : 0) | (events & UV_WRITABLE ? G_IO_OUT : 0));
         #ifdef VERBOSE_LOGGING
             std::cerr << "    pfd->fd: " << pfd->fd << "pfd->events: " << pfd->events << std::endl;
@@ -106,27 +237,32 @@ static void poll_cb(uv_poll_t* handle, int status, int events)
         #endif
     }
 
-    pfdMap.erase(fd);
+    w->firstPfd = -1;
+    w->armed = false;
     uv_poll_stop(handle);
 }
 
-static void prepare_cb(uv_prepare_t* w)
+static void remove_watcher(struct econtext* ctx, int fd)
 {
-    struct econtext* ctx = (struct econtext*)(((char*)w) - offsetof(struct econtext, pw));
-    gint timeout;
-    int i;
-
-    // return if uv_timeout is active
-    if (!query)
-        return;
+    FdWatcher *w = ctx->watchers[fd];
+    #ifdef VERBOSE_LOGGING
+    std::cerr << "removing uv_poll_t for fd:" << fd <<std::endl;
+    #endif
+    uv_poll_stop(&w->poll);
+    uv_close((uv_handle_t *) &w->poll, close_cb);
+    ctx->watchers[fd] = 0;
+}
 
+// Prepare the glib main context and fetch its GPollFDs into ctx->pfd
+static void query_context(struct econtext* ctx, gint* timeout)
+{
     g_main_context_prepare(ctx->gc, &ctx->maxpri);
 
     // Get all sources from glib main context
     while (ctx->afd < (ctx->nfd = g_main_context_query(
                                       ctx->gc,
                                       ctx->maxpri,
-                                      &timeout,
+                                      timeout,
                                       ctx->pfd,
                                       ctx->afd))
           ) {
@@ -140,14 +276,33 @@ static void prepare_cb(uv_prepare_t* w)
 
         ctx->pfd = (GPollFD*)malloc(ctx->afd * sizeof(GPollFD));
     }
+}
 
-    // store read/write flags for each FD
-    EventMap events;
+static void prepare_cb(uv_prepare_t* w)
+{
+    struct econtext* ctx = (struct econtext*)(((char*)w) - offsetof(struct econtext, pw));
+    gint timeout;
+    int i;
 
-    // libuv does not support more than one watcher on same fd
-    // iterate through GPollFD list, accumulating read/write flags for each FD, and creating a map from fd to GpollFD
-    // for event dispatch in poll_cb()
-    pfdMap.clear();
+    // return if uv_timeout is active
+    if (!ctx->query) {
+        ctx->policy.skippedPrepares++;
+        return;
+    }
+    ctx->stats.resumedFrom = ctx->stats.holdoffStart;
+    ctx->stats.holdoffStart = 0;
+
+    query_context(ctx, &timeout);
+    ctx->stats.prepares++;
+    ctx->stats.fdsPolled.Record(ctx->nfd);
+
+    // iterate through GPollFD list, accumulating read/write flags for each FD into
+    // its watcher, and chaining GPollFDs with the same fd for event dispatch in poll_cb()
+    ++ctx->generation;
+    if (ctx->pfdNext.size() < (size_t) ctx->nfd) {
+        ctx->pfdNext.resize(ctx->afd);
+    }
+    ctx->nextActiveFds.clear();
     for (i = 0; i < ctx->nfd; ++i) {
         GPollFD* pfd = ctx->pfd + i;
         int fd = pfd->fd;
@@ -158,63 +313,59 @@ static void prepare_cb(uv_prepare_t* w)
         #endif
         //reset received events for the GPollFD
         pfd->revents = 0;
-        // Create a map of fds to GPollFD objects
-        pfdMap.insert(std::pair<int, GPollFD *>(fd, pfd));
-        EventMap::iterator it = events.find(fd);
-        if (it != events.end()) {
-            it->second |= uv_events;
-        } else {
-            events.insert(std::pair<int, int>(fd, uv_events));
+
+        if ((size_t) fd >= ctx->watchers.size()) {
+            ctx->watchers.resize(fd + 1, 0);
         }
-    }
-    // Create poll handles where necessary, and start polling
-    for (EventMap::iterator it = events.begin(); it != events.end(); it++) {
-        uv_poll_t *pollw;
-        std::pair<int, int> p = *it;
-        int fd = p.first;
-        int mask = p.second;
-        #ifdef VERBOSE_LOGGING
-            std::cerr << "fd: " << fd << ", mask: " << mask << std::endl;
-        #endif
-        WatcherMap::iterator pollFound = pollwMap.find(fd);
-        if (pollFound == pollwMap.end()) {
+        FdWatcher *fw = ctx->watchers[fd];
+        if (!fw) {
             // not found - create a new uv_poll_t watcher, and initialize it
             #ifdef VERBOSE_LOGGING
                 std::cerr << "creating new uv_poll_t for fd:" << fd <<std::endl;
             #endif
-            pollw = new uv_poll_t;
-            PollData *pd = new PollData;
-            pd->fd = fd;
-            pollw->data = pd;
-            pollwMap.insert(std::pair<int, uv_poll_t*>(fd, pollw));
-            uv_poll_init(uv_default_loop(), pollw, fd);
-        } else {
-            // reuse existing watcher
-            std::pair<int, uv_poll_t *> p = *pollFound;
-            pollw = p.second;
+            fw = new FdWatcher;
+            fw->ctx = ctx;
+            fw->fd = fd;
+            fw->mask = 0;
+            fw->armed = false;
+            fw->generation = 0;
+            fw->poll.data = fw;
+            uv_poll_init(ctx->loop, &fw->poll, fd);
+            ctx->openWatchers++;
+            ctx->watchers[fd] = fw;
+        }
+        if (fw->generation != ctx->generation) {
+            fw->generation = ctx->generation;
+            fw->pendingMask = 0;
+            fw->firstPfd = -1;
+            ctx->nextActiveFds.push_back(fd);
+        }
+        ctx->pfdNext[i] = fw->firstPfd;
+        fw->firstPfd = i;
+        fw->pendingMask |= uv_events;
+    }
+
+    // Start polling where the mask changed, or where poll_cb stopped the watcher.
+    // This will reset the mask if the watcher is already started.
+    for (std::vector<int>::const_iterator it = ctx->nextActiveFds.begin(); it != ctx->nextActiveFds.end(); ++it) {
+        FdWatcher *fw = ctx->watchers[*it];
+        #ifdef VERBOSE_LOGGING
+            std::cerr << "fd: " << fw->fd << ", mask: " << fw->pendingMask << std::endl;
+        #endif
+        if (!fw->armed || fw->mask != fw->pendingMask) {
+            uv_poll_start(&fw->poll, fw->pendingMask, poll_cb);
+            fw->mask = fw->pendingMask;
+            fw->armed = true;
         }
-        // Feed fd data to libuv and start polling
-        // This will reset the mask if pollw is already registered
-        uv_poll_start(pollw, mask, poll_cb);
     }
 
     // remove watchers that are no longer needed
-    for (WatcherMap::iterator it = pollwMap.begin(), next; it != pollwMap.end(); it = next) {
-        std::pair<int, uv_poll_t *> p = *it;
-        next = it;
-        next++;
-        int fd = p.first;
-        uv_poll_t *pollw = p.second;
-        EventMap::iterator eventFound = events.find(fd);
-        if (eventFound == events.end()) {
-            #ifdef VERBOSE_LOGGING
-            std::cerr << "removing uv_poll_t for fd:" << fd <<std::endl;
-            #endif
-            uv_poll_stop(pollw);
-            uv_close((uv_handle_t *) pollw, close_cb);
-            pollwMap.erase(it); // invalidates "it", don't use it after this
+    for (std::vector<int>::const_iterator it = ctx->activeFds.begin(); it != ctx->activeFds.end(); ++it) {
+        if (ctx->watchers[*it]->generation != ctx->generation) {
+            remove_watcher(ctx, *it);
         }
     }
+    ctx->activeFds.swap(ctx->nextActiveFds);
 
     if (timeout >= 0) {
         uv_timer_start(&ctx->tw, timeout_cb, timeout * 1e-3, 0);
@@ -229,22 +380,448 @@ static void check_cb(uv_check_t* w)
         uv_timer_stop(&ctx->tw);
     }
 
+    ctx->policy.checks++;
     int ready = g_main_context_check(ctx->gc, ctx->maxpri, ctx->pfd, ctx->nfd);
-    if(ready)
-        g_main_context_dispatch(ctx->gc);  
+    ctx->stats.resumedFrom = 0;
+    if(ready) {
+        ctx->policy.dispatches++;
+        uint64_t messages = ctx->stats.messages;
+        uint64_t start = uv_hrtime();
+        begin_budget(ctx);
+        g_main_context_dispatch(ctx->gc);
+        LS2Base::FlushBatches();
+        ctx->stats.dispatchTime.Record((uv_hrtime() - start) / 1000);
+        ctx->stats.messagesPerDispatch.Record(ctx->stats.messages - messages);
+    }
+
+    switch (ctx->policy.mode) {
+    case kPolicyImmediate:
+        ctx->policy.interval = 0;
+        break;
+    case kPolicyFixed:
+        ctx->policy.interval = ctx->policy.minInterval;
+        break;
+    case kPolicyAdaptive:
+        if (ready) {
+            ctx->policy.interval = ctx->policy.minInterval;
+        } else {
+            ctx->policy.interval = std::min(std::max(ctx->policy.interval * 2, 1u), ctx->policy.maxInterval);
+        }
+        break;
+    }
+
+    if (ctx->policy.interval == 0) {
+        ctx->query = true;
+        return;
+    }
 
     // libuv is too fast for glib, hold on for a while
-    query = false;
-    if (!uv_is_active((uv_handle_t*) &timeout_handle)) {
-        uv_timer_start(&timeout_handle, uv_timeout_cb, 1, 0);   // 1ms
+    ctx->query = false;
+    if (!ctx->stats.holdoffStart) {
+        ctx->stats.holdoffStart = uv_hrtime();
+    }
+    if (!uv_is_active((uv_handle_t*) &ctx->timeout_handle)) {
+        uv_timer_start(&ctx->timeout_handle, uv_timeout_cb, ctx->policy.interval, 0);
     }
 }
 
-static struct econtext default_context;
+struct econtext* CurrentContext()
+{
+    return tContext;
+}
 
 GMainLoop* GetMainLoop()
 {
-    return gMainLoop;
+    return tContext->mainLoop;
+}
+
+bool OnBusThread()
+{
+    return tOnBusThread;
+}
+
+BusLock::BusLock()
+    : fMutex(tContext && tContext->busThread ? &tContext->busMutex : 0)
+{
+    if (fMutex) {
+        fMutex->lock();
+    }
+}
+
+BusLock::~BusLock()
+{
+    if (fMutex) {
+        fMutex->unlock();
+    }
+}
+
+void QueueMessage(struct econtext* ctx, uint64_t target, int kind, LSMessage* message)
+{
+    QueuedMessage* item = new QueuedMessage;
+    item->fTarget = target;
+    item->fKind = kind;
+    item->fMessage = message;
+    if (message) {
+        LSMessageRef(message);
+    }
+    ctx->queued++;
+    ctx->queue.Push(item);
+    uv_async_send(&ctx->aw);
+}
+
+// Deliver the messages queued by the bus thread, or carried over by the dispatch
+// budget, as far as the budget allows. Runs on the JS thread.
+static void async_cb(uv_async_t* w)
+{
+    struct econtext* ctx = (struct econtext*)(((char*)w) - offsetof(struct econtext, aw));
+    Isolate* isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    begin_budget(ctx);
+    while (!budget_exhausted(ctx)) {
+        QueuedMessage* item = ctx->queue.Pop();
+        if (!item) {
+            break;
+        }
+        ctx->queued--;
+        LS2Base* target = LS2Base::FromSerial(item->fTarget);
+        if (target) {
+            RecordDeliveredMessage();
+            target->MessageArrived(static_cast<LS2Base::MessageKind>(item->fKind), item->fMessage);
+        }
+        if (item->fMessage) {
+            LSMessageUnref(item->fMessage);
+        }
+        delete item;
+    }
+    LS2Base::FlushBatches();
+
+    // Carry the rest over to the next loop iteration
+    if (ctx->queued.load() > 0) {
+        uv_async_send(&ctx->aw);
+    }
+}
+
+// Iterate the glib main context on the bus thread. This is g_main_context_iterate()
+// with the check and dispatch steps done under busMutex.
+static gpointer bus_thread_cb(gpointer data)
+{
+    struct econtext* ctx = (struct econtext*)data;
+    gint timeout;
+
+    tOnBusThread = true;
+    g_main_context_acquire(ctx->gc);
+    while (!ctx->busThreadStop.load()) {
+        query_context(ctx, &timeout);
+        g_poll(ctx->pfd, ctx->nfd, timeout);
+
+        std::lock_guard<std::mutex> lock(ctx->busMutex);
+        if (g_main_context_check(ctx->gc, ctx->maxpri, ctx->pfd, ctx->nfd)) {
+            g_main_context_dispatch(ctx->gc);
+        }
+    }
+    g_main_context_release(ctx->gc);
+    return NULL;
+}
+
+static void stop_uv_bridge(struct econtext* ctx)
+{
+    uv_prepare_stop(&ctx->pw);
+    uv_check_stop(&ctx->cw);
+    uv_timer_stop(&ctx->tw);
+    uv_timer_stop(&ctx->timeout_handle);
+
+    for (std::vector<int>::const_iterator it = ctx->activeFds.begin(); it != ctx->activeFds.end(); ++it) {
+        remove_watcher(ctx, *it);
+    }
+    ctx->activeFds.clear();
+}
+
+static void start_uv_bridge(struct econtext* ctx)
+{
+    ctx->query = true;
+    uv_prepare_start(&ctx->pw, prepare_cb);
+    uv_check_start(&ctx->cw, check_cb);
+}
+
+static void start_bus_thread(struct econtext* ctx)
+{
+    if (ctx->busThread) {
+        return;
+    }
+    stop_uv_bridge(ctx);
+    ctx->busThreadStop.store(false);
+    ctx->busThread = g_thread_new("ls2-bus", bus_thread_cb, ctx);
+}
+
+static void stop_bus_thread(struct econtext* ctx)
+{
+    if (!ctx->busThread) {
+        return;
+    }
+    ctx->busThreadStop.store(true);
+    g_main_context_wakeup(ctx->gc);
+    g_thread_join(ctx->busThread);
+    ctx->busThread = 0;
+}
+
+// Reads an optional unsigned property of an options object
+static unsigned GetPolicyInterval(Local<Object> options, const char* name, unsigned defaultValue)
+{
+    Isolate* isolate = Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Value> value = options->Get(context, String::NewFromUtf8(isolate, name).ToLocalChecked()).ToLocalChecked();
+    if (value->IsUndefined()) {
+        return defaultValue;
+    }
+    if (!value->IsNumber() || value->NumberValue(context).FromJust() < 0) {
+        throw std::runtime_error(std::string(name) + " must be a non-negative number");
+    }
+    return value->Uint32Value(context).FromJust();
+}
+
+// setLoopPolicy({mode, interval, minInterval, maxInterval})
+static void SetLoopPolicy(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    try {
+        if (args.Length() != 1 || !args[0]->IsObject()) {
+            throw std::runtime_error("Invalid arguments");
+        }
+        Local<Object> options = Local<Object>::Cast(args[0]);
+        ConvertFromJS<std::string> mode(options->Get(isolate->GetCurrentContext(),
+            String::NewFromUtf8(isolate, "mode").ToLocalChecked()).ToLocalChecked());
+
+        struct econtext* ctx = tContext;
+        LoopPolicy p = ctx->policy;
+        if (mode.value() == "immediate") {
+            p.mode = kPolicyImmediate;
+            p.minInterval = p.maxInterval = 0;
+        } else if (mode.value() == "fixed") {
+            p.mode = kPolicyFixed;
+            p.minInterval = p.maxInterval = GetPolicyInterval(options, "interval", 1);
+        } else if (mode.value() == "adaptive") {
+            p.mode = kPolicyAdaptive;
+            p.minInterval = GetPolicyInterval(options, "minInterval", 0);
+            p.maxInterval = GetPolicyInterval(options, "maxInterval", 16);
+            if (p.minInterval > p.maxInterval) {
+                throw std::runtime_error("minInterval must not exceed maxInterval");
+            }
+        } else {
+            throw std::runtime_error("Unknown loop policy mode: " + mode.value());
+        }
+        p.interval = p.minInterval;
+        ctx->policy = p;
+
+        // Don't leave a longer hold-off from the old policy running
+        if (uv_is_active((uv_handle_t*) &ctx->timeout_handle)) {
+            uv_timer_stop(&ctx->timeout_handle);
+        }
+        ctx->query = true;
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
+    }
+}
+
+static void SetNumber(Local<Object> target, const char* name, double value)
+{
+    Isolate* isolate = Isolate::GetCurrent();
+    target->Set(isolate->GetCurrentContext(),
+                String::NewFromUtf8(isolate, name).ToLocalChecked(),
+                Number::New(isolate, value)).Check();
+}
+
+// getLoopPolicy(): the current policy and its counters
+static void GetLoopPolicy(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+    Local<Object> result = Object::New(isolate);
+    struct econtext* ctx = tContext;
+
+    result->Set(isolate->GetCurrentContext(),
+                String::NewFromUtf8(isolate, "mode").ToLocalChecked(),
+                String::NewFromUtf8(isolate, policyModeNames[ctx->policy.mode]).ToLocalChecked()).Check();
+    SetNumber(result, "interval", ctx->policy.interval);
+    SetNumber(result, "minInterval", ctx->policy.minInterval);
+    SetNumber(result, "maxInterval", ctx->policy.maxInterval);
+    SetNumber(result, "checks", ctx->policy.checks);
+    SetNumber(result, "dispatches", ctx->policy.dispatches);
+    SetNumber(result, "skippedPrepares", ctx->policy.skippedPrepares);
+    SetNumber(result, "timerWakeups", ctx->policy.timerWakeups);
+
+    args.GetReturnValue().Set(result);
+}
+
+static void SetHistogram(Local<Object> target, const char* name, const LS2Histogram& histogram)
+{
+    Isolate* isolate = Isolate::GetCurrent();
+    target->Set(isolate->GetCurrentContext(),
+                String::NewFromUtf8(isolate, name).ToLocalChecked(),
+                histogram.ToJS(isolate)).Check();
+}
+
+// getLoopStats([reset]): counters and histograms of the libuv bridge
+static void GetLoopStats(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+    Local<Object> result = Object::New(isolate);
+    struct econtext* ctx = tContext;
+
+    SetNumber(result, "prepares", ctx->stats.prepares);
+    SetNumber(result, "skippedPrepares", ctx->policy.skippedPrepares);
+    SetNumber(result, "checks", ctx->policy.checks);
+    SetNumber(result, "dispatches", ctx->policy.dispatches);
+    SetNumber(result, "timerWakeups", ctx->policy.timerWakeups);
+    SetNumber(result, "messages", ctx->stats.messages);
+    SetNumber(result, "deferredMessages", ctx->stats.deferred);
+    SetHistogram(result, "fdsPolled", ctx->stats.fdsPolled);
+    SetHistogram(result, "dispatchTime", ctx->stats.dispatchTime);
+    SetHistogram(result, "messagesPerDispatch", ctx->stats.messagesPerDispatch);
+    SetHistogram(result, "holdoffDelay", ctx->stats.holdoffDelay);
+
+    if (args.Length() > 0 && args[0]->BooleanValue(isolate)) {
+        ctx->stats.prepares = 0;
+        ctx->stats.messages = 0;
+        ctx->stats.deferred = 0;
+        ctx->stats.fdsPolled.Reset();
+        ctx->stats.dispatchTime.Reset();
+        ctx->stats.messagesPerDispatch.Reset();
+        ctx->stats.holdoffDelay.Reset();
+        ctx->policy.skippedPrepares = 0;
+        ctx->policy.checks = 0;
+        ctx->policy.dispatches = 0;
+        ctx->policy.timerWakeups = 0;
+    }
+
+    args.GetReturnValue().Set(result);
+}
+
+static void context_close_cb(uv_handle_t* handle)
+{
+    struct econtext* ctx = (struct econtext*) handle->data;
+    ctx->pendingCloses--;
+    finish_cleanup(ctx);
+}
+
+// A limit of the dispatch budget: a whole number, 0 (no limit) when left out
+static unsigned GetBudgetLimit(Local<Object> options, const char* name)
+{
+    Isolate* isolate = Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Value> value = options->Get(context, String::NewFromUtf8(isolate, name).ToLocalChecked()).ToLocalChecked();
+    if (value->IsUndefined()) {
+        return 0;
+    }
+    double limit = value->IsNumber() ? value->NumberValue(context).FromJust() : -1;
+    if (!(limit >= 0 && limit <= UINT32_MAX) || limit != std::floor(limit)) {
+        throw std::runtime_error(std::string("Dispatch budget ") + name +
+                                 " must be a whole number of at least 0");
+    }
+    return static_cast<unsigned>(limit);
+}
+
+// setDispatchBudget({maxMessages, maxTime}): limit what one loop iteration
+// delivers to JS; maxTime is in ms
+static void SetDispatchBudget(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    try {
+        if (args.Length() != 1 || !args[0]->IsObject()) {
+            throw std::runtime_error("setDispatchBudget takes an object with maxMessages and maxTime");
+        }
+        Local<Object> options = Local<Object>::Cast(args[0]);
+        struct econtext* ctx = tContext;
+        unsigned maxMessages = GetBudgetLimit(options, "maxMessages");
+        unsigned maxTime = GetBudgetLimit(options, "maxTime");
+        ctx->budget.maxMessages = maxMessages;
+        ctx->budget.maxTime = uint64_t(maxTime) * 1000000;
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
+    }
+}
+
+// Frees the bridge once the last of its uv handles is closed, and lets node
+// carry on with the teardown of the environment
+static void finish_cleanup(struct econtext* ctx)
+{
+    if (!ctx->cleanupDone || ctx->pendingCloses > 0 || ctx->openWatchers > 0) {
+        return;
+    }
+    void (*done)(void*) = ctx->cleanupDone;
+    void* doneArg = ctx->cleanupDoneArg;
+
+    g_main_loop_unref(ctx->mainLoop);
+    g_main_context_unref(ctx->gc);
+    free(ctx->pfd);
+    node::RemoveEnvironmentCleanupHook(std::move(ctx->cleanupHook));
+    delete ctx;
+    done(doneArg);
+}
+
+// Tear down the bridge of an environment that is going away. The handles are
+// closed here; node runs the loop until their close callbacks are done.
+static void cleanup_cb(void* arg, void (*done)(void*), void* doneArg)
+{
+    struct econtext* ctx = (struct econtext*)arg;
+    if (tContext == ctx) {
+        tContext = 0;
+    }
+
+    stop_bus_thread(ctx);
+    // Drop whatever the bus thread left behind
+    while (QueuedMessage* item = ctx->queue.Pop()) {
+        if (item->fMessage) {
+            LSMessageUnref(item->fMessage);
+        }
+        delete item;
+    }
+    ctx->queued = 0;
+
+    ctx->cleanupDone = done;
+    ctx->cleanupDoneArg = doneArg;
+    ctx->pendingCloses = 5;
+    stop_uv_bridge(ctx);
+    uv_close((uv_handle_t*) &ctx->pw, context_close_cb);
+    uv_close((uv_handle_t*) &ctx->cw, context_close_cb);
+    uv_close((uv_handle_t*) &ctx->tw, context_close_cb);
+    uv_close((uv_handle_t*) &ctx->timeout_handle, context_close_cb);
+    uv_close((uv_handle_t*) &ctx->aw, context_close_cb);
+}
+
+// setBusThread(enabled): run the glib main context on a dedicated thread instead
+// of the libuv prepare/check watchers
+static void SetBusThread(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    try {
+        if (args.Length() != 1) {
+            throw std::runtime_error("Invalid number of parameters");
+        }
+        struct econtext* ctx = tContext;
+        if (args[0]->BooleanValue(isolate)) {
+            start_bus_thread(ctx);
+        } else if (ctx->busThread) {
+            // Messages still in the queue are delivered by the pending async callback
+            stop_bus_thread(ctx);
+            start_uv_bridge(ctx);
+        }
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
+    }
 }
 
 extern "C" NODE_MODULE_EXPORT void
@@ -253,30 +830,73 @@ NODE_MODULE_INITIALIZER(v8::Local<v8::Object> exports,
                         v8::Local<v8::Context> context) {
     Isolate* isolate = context->GetIsolate();
     HandleScope scope(isolate);
-    gMainLoop = g_main_loop_new(NULL, true);
 
-    GMainContext *gc = g_main_context_default();
-    struct econtext *ctx = &default_context;
+    struct econtext *ctx = new econtext;
+    ctx->loop = node::GetCurrentEventLoop(isolate);
 
-    ctx->gc = g_main_context_ref (gc);
+    // The main environment runs on the default uv loop and keeps using the default
+    // glib main context; each worker gets a main context of its own
+    if (ctx->loop == uv_default_loop()) {
+        ctx->gc = g_main_context_ref(g_main_context_default());
+    } else {
+        ctx->gc = g_main_context_new();
+    }
+    ctx->mainLoop = g_main_loop_new(ctx->gc, true);
     ctx->nfd = 0;
     ctx->afd = 0;
     ctx->pfd = 0;
-
-    query = true;
+    ctx->generation = 0;
+    ctx->busThread = 0;
+    ctx->openWatchers = 0;
+    ctx->pendingCloses = 0;
+    ctx->cleanupDone = 0;
+    ctx->cleanupDoneArg = 0;
+
+    ctx->query = true;
+    LoopPolicy defaultPolicy = { kPolicyFixed, 1, 1, 1, 0, 0, 0, 0 };
+    ctx->policy = defaultPolicy;
+    ctx->stats.prepares = 0;
+    ctx->stats.messages = 0;
+    ctx->stats.holdoffStart = 0;
+    ctx->stats.resumedFrom = 0;
+    ctx->stats.deferred = 0;
+    ctx->budget.maxMessages = 0;
+    ctx->budget.maxTime = 0;
+    ctx->budget.used = 0;
+    ctx->budget.start = 0;
+    ctx->queued = 0;
+
+    tContext = ctx;
 
     // Prepare
-    uv_prepare_init (uv_default_loop(), &ctx->pw);
+    uv_prepare_init (ctx->loop, &ctx->pw);
     uv_prepare_start (&ctx->pw, prepare_cb);
     uv_unref((uv_handle_t*) &ctx->pw);
 
-    uv_check_init(uv_default_loop(), &ctx->cw);
+    uv_check_init(ctx->loop, &ctx->cw);
     uv_check_start (&ctx->cw, check_cb);
     uv_unref((uv_handle_t*) &ctx->cw);
 
     // Timer
-    uv_timer_init(uv_default_loop(), &ctx->tw);
-    uv_timer_init(uv_default_loop(), &timeout_handle);
+    uv_timer_init(ctx->loop, &ctx->tw);
+    uv_timer_init(ctx->loop, &ctx->timeout_handle);
+
+    // Bus thread hand-over. Left referenced: it keeps the loop alive whatever
+    // the loop policy, as timeout_handle used to.
+    uv_async_init(ctx->loop, &ctx->aw, async_cb);
+
+    ctx->pw.data = ctx;
+    ctx->cw.data = ctx;
+    ctx->tw.data = ctx;
+    ctx->timeout_handle.data = ctx;
+    ctx->aw.data = ctx;
+    ctx->cleanupHook = node::AddEnvironmentCleanupHook(isolate, cleanup_cb, ctx);
+
+    NODE_SET_METHOD(exports, "setBusThread", SetBusThread);
+    NODE_SET_METHOD(exports, "setLoopPolicy", SetLoopPolicy);
+    NODE_SET_METHOD(exports, "getLoopPolicy", GetLoopPolicy);
+    NODE_SET_METHOD(exports, "getLoopStats", GetLoopStats);
+    NODE_SET_METHOD(exports, "setDispatchBudget", SetDispatchBudget);
 
     LS2Handle::Initialize(exports, context);
     LS2Message::Initialize(exports, context);
@@ -18,7 +18,54 @@
 #define NODE_LS2_H
 
 #include <glib.h>
+#include <luna-service2/lunaservice.h>
+#include <mutex>
+#include <stdint.h>
 
+// The bridge between the libuv loop of a Node.js environment and the glib main
+// context its LS2 handles are attached to. Each environment that loads the addon
+// (the main thread and every worker) has its own.
+struct econtext;
+
+// The bridge of the environment running on the calling thread
+econtext* CurrentContext();
+
+// The glib main loop of the calling thread's environment
 GMainLoop* GetMainLoop();
 
+// True when called on the dedicated bus thread, i.e. when LS2 callbacks must not
+// touch V8 and should hand their message over with QueueMessage instead.
+bool OnBusThread();
+
+// Count a message delivered to a Handle or Call object, for getLoopStats().
+// Must be called on the JS thread.
+void RecordDeliveredMessage();
+
+// True when a message arriving on the JS thread must be queued rather than
+// delivered, because the dispatch budget of this loop iteration is used up or
+// earlier messages are still queued.
+bool DeferDelivery(econtext* ctx);
+
+// Queue a message for delivery on the JS thread of ctx to the LS2Base object with
+// the given serial number. Takes a reference on the message for the time it
+// spends in the queue. The message may be NULL for notifications that carry their
+// data elsewhere.
+void QueueMessage(econtext* ctx, uint64_t target, int kind, LSMessage* message);
+
+// Held by the bus thread while it dispatches, and by the JS thread while it
+// cancels calls or unregisters handles, so that LS2 never invokes a callback on
+// an object that is being torn down. Does nothing unless the bus thread runs.
+class BusLock {
+public:
+    BusLock();
+    ~BusLock();
+
+private:
+    // prevent copying
+    BusLock( const BusLock& );
+    const BusLock& operator=( const BusLock& );
+
+    std::mutex* fMutex;
+};
+
 #endif
@@ -14,15 +14,59 @@
 //
 // SPDX-License-Identifier: Apache-2.0
 
+#include "node_ls2.h"
 #include "node_ls2_base.h"
 #include "node_ls2_message.h"
 
 #include <syslog.h>
 #include <stdlib.h>
+#include <unordered_map>
 
 using namespace node;
 using namespace v8;
 
+// Live objects by serial number, per environment. Only touched on the JS thread.
+typedef std::unordered_map<uint64_t, LS2Base*> SerialMap;
+static thread_local SerialMap tLiveObjects;
+static thread_local uint64_t tNextSerial = 1;
+
+// Objects with a batch waiting for FlushBatches(), by serial number
+static thread_local std::vector<uint64_t> tPendingBatches;
+
+LS2Base::LS2Base()
+    : fContext(CurrentContext())
+    , fSerial(tNextSerial++)
+    , fBatching(false)
+{
+    tLiveObjects[fSerial] = this;
+}
+
+LS2Base::~LS2Base()
+{
+    tLiveObjects.erase(fSerial);
+}
+
+LS2Base* LS2Base::FromSerial(uint64_t serial)
+{
+    SerialMap::const_iterator it = tLiveObjects.find(serial);
+    return it != tLiveObjects.end() ? it->second : 0;
+}
+
+bool LS2Base::Deliver(MessageKind kind, LSMessage *message)
+{
+    if (OnBusThread() || DeferDelivery(fContext)) {
+        QueueMessage(fContext, fSerial, kind, message);
+        return true;
+    }
+    RecordDeliveredMessage();
+    return MessageArrived(kind, message);
+}
+
+void LS2Base::DeliverLater(MessageKind kind, LSMessage *message)
+{
+    QueueMessage(fContext, fSerial, kind, message);
+}
+
 void LS2Base::EmitMessage(const Local<String>& symbol, LSMessage *message)
 {
     Local<Value> messageObject = LS2Message::NewFromMessage(message);
@@ -48,3 +92,86 @@ void LS2Base::EmitMessage(const Local<String>& symbol, LSMessage *message)
         abort();
     }
 }
+
+void LS2Base::EmitOrBatchMessage(const Local<String>& symbol, const Local<String>& batchSymbol,
+                                 LSMessage *message)
+{
+    if (!fBatching) {
+        EmitMessage(symbol, message);
+        return;
+    }
+
+    Local<Value> messageObject = LS2Message::NewFromMessage(message);
+    if (messageObject.IsEmpty()) {
+        // We don't want to silently lose messages
+        syslog(LOG_USER | LOG_CRIT, "%s: messageObject is empty", __PRETTY_FUNCTION__);
+        abort();
+    }
+    EmitOrBatchMessage(symbol, batchSymbol, messageObject);
+}
+
+// Same for a message object made by the caller
+void LS2Base::EmitOrBatchMessage(const Local<String>& symbol, const Local<String>& batchSymbol,
+                                 Local<Value> messageObject)
+{
+    Isolate* isolate = Isolate::GetCurrent();
+    if (!fBatching) {
+        Local<Value> argv[2] = { symbol, messageObject };
+        MakeCallback(isolate, this->handle(), static_cast<const char*>("emit"), 2, argv);
+        return;
+    }
+
+    if (fBatch.empty()) {
+        // Stay alive until the batch is emitted, even if the call completes
+        Ref();
+        tPendingBatches.push_back(fSerial);
+        fBatchSymbol.Reset(isolate, batchSymbol);
+    }
+    fBatch.emplace_back(isolate, messageObject);
+}
+
+void LS2Base::SetBatching(bool batching)
+{
+    fBatching = batching;
+}
+
+void LS2Base::Flush()
+{
+    Isolate* isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    Local<Array> messages = Array::New(isolate, fBatch.size());
+    Local<Context> context = isolate->GetCurrentContext();
+    for (size_t i = 0; i < fBatch.size(); ++i) {
+        messages->Set(context, i, fBatch[i].Get(isolate)).Check();
+    }
+    fBatch.clear();
+
+    Local<Value> argv[2] =
+    {
+        fBatchSymbol.Get(isolate), // event name
+        messages  // argument
+    };
+
+    MakeCallback(isolate,
+                 this->handle(),
+                 static_cast<const char*>("emit"),
+                 2,
+                 static_cast<v8::Local<v8::Value>*>(argv));
+    Unref();
+}
+
+void LS2Base::FlushBatches()
+{
+    if (tPendingBatches.empty()) {
+        return;
+    }
+    std::vector<uint64_t> pending;
+    pending.swap(tPendingBatches);
+    for (size_t i = 0; i < pending.size(); ++i) {
+        LS2Base* target = FromSerial(pending[i]);
+        if (target && !target->fBatch.empty()) {
+            target->Flush();
+        }
+    }
+}
@@ -20,14 +20,76 @@
 #include <luna-service2/lunaservice.h>
 #include <node.h>
 #include <node_object_wrap.h>
+#include <stdint.h>
+#include <vector>
 
 class LS2Handle;
+struct econtext;
 
 class LS2Base : public node::ObjectWrap {
+public:
+	// The kinds of message the bus delivers to an LS2Base object.
+	enum MessageKind {
+		kRequestMessage,
+		kResponseMessage,
+		kCancelMessage,
+		kAsyncResponseMessage,  // response to a Handle.callAsync()
+		kSharedResponseMessage, // update of a subscription shared by several Calls
+		kReplayMessage,         // last update of a shared subscription, for a late joiner
+		kServiceStatusMessage,  // no message; a server status watch fired
+		kAdmissionMessage       // no message; admission slots of a Handle were freed
+	};
+
+	// Returns the live object with the given serial number, or 0 if it has been
+	// collected since.
+	static LS2Base* FromSerial(uint64_t serial);
+
+	// Handle a message of the given kind on the JS thread.
+	virtual bool MessageArrived(MessageKind kind, LSMessage *message) = 0;
+
+	// Called when a timer added to the LS2TimerWheel for this object expires.
+	virtual void TimerExpired(uint64_t cookie) {}
+
+	// Emit the messages batched since the last flush by every object of the
+	// calling thread's environment. Called by the bridge after each dispatch.
+	static void FlushBatches();
+
 protected:
+	LS2Base();
+	virtual ~LS2Base();
+
+	// Identifies this object to FromSerial()
+	uint64_t Serial() const { return fSerial; }
+
+	// Called from the LS2 callbacks. Delivers the message right away on the JS
+	// thread, or queues it for the JS thread when called on the bus thread.
+	bool Deliver(MessageKind kind, LSMessage *message);
+
+	// Queues the message for delivery in a later turn of the event loop.
+	void DeliverLater(MessageKind kind, LSMessage *message);
+
 	// Common routine called whenever a message arrives from the bus. Different symbols
 	// are used to differentiate requests, responses and cancelled subscriptions
 	void EmitMessage(const v8::Local<v8::String>& symbol, LSMessage *message);
+
+	// When batching, adds the message to the batch emitted with batchSymbol at the
+	// end of the dispatch cycle; otherwise emits it right away with symbol.
+	void EmitOrBatchMessage(const v8::Local<v8::String>& symbol,
+	                        const v8::Local<v8::String>& batchSymbol, LSMessage *message);
+	void EmitOrBatchMessage(const v8::Local<v8::String>& symbol,
+	                        const v8::Local<v8::String>& batchSymbol, v8::Local<v8::Value> messageObject);
+
+	void SetBatching(bool batching);
+
+private:
+	void Flush();
+
+	econtext* fContext;
+	uint64_t fSerial;
+
+	bool fBatching;
+	v8::Global<v8::String> fBatchSymbol;
+	std::vector<v8::Global<v8::Value> > fBatch;
 };
 
 #endif
@@ -14,9 +14,12 @@
 //
 // SPDX-License-Identifier: Apache-2.0
 
+#include "node_ls2.h"
 #include "node_ls2_call.h"
 #include "node_ls2_error_wrapper.h"
 #include "node_ls2_handle.h"
+#include "node_ls2_message.h"
+#include "node_ls2_timer_wheel.h"
 #include "node_ls2_utils.h"
 
 #include <cstring>
@@ -29,9 +32,12 @@ using namespace std;
 using namespace v8;
 using namespace node;
 
-Persistent<FunctionTemplate> LS2Call::gCallTemplate;
+// Per environment, as each worker has its own isolate
+thread_local Persistent<FunctionTemplate> LS2Call::gCallTemplate;
+thread_local Persistent<Function> LS2Call::gCallFunction;
 
-static Persistent<String> response_symbol;
+static thread_local Persistent<String> response_symbol;
+static thread_local Persistent<String> responses_symbol;
 
 // Called during add-on initialization to add the "Call" template function
 // to the target object.
@@ -51,10 +57,21 @@ void LS2Call::Initialize (Local<Object> target, v8::Local<v8::Context> context)
 
     NODE_SET_PROTOTYPE_METHOD(t, "cancel", CancelWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "setResponseTimeout", SetResponseTimeoutWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "pause", PauseWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "resume", ResumeWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "pull", PullWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "setQueueLimit", SetQueueLimitWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "getQueueStats", GetQueueStatsWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "setBatching", SetBatchingWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "getRetryStats", GetRetryStatsWrapper);
 
     response_symbol.Reset(isolate, String::NewFromUtf8(isolate, "response").ToLocalChecked());
+    responses_symbol.Reset(isolate, String::NewFromUtf8(isolate, "responses").ToLocalChecked());
 
-    target->Set(currentContext, String::NewFromUtf8(isolate, "Call").ToLocalChecked(), t->GetFunction(currentContext).ToLocalChecked());
+    Local<Function> function = t->GetFunction(currentContext).ToLocalChecked();
+    gCallFunction.Reset(isolate, function);
+
+    target->Set(currentContext, String::NewFromUtf8(isolate, "Call").ToLocalChecked(), function);
 }
 
 // Used by LSHandle to create a "Call" object that wraps a particular
@@ -63,8 +80,7 @@ Local<Object> LS2Call::NewForCall()
 {
     v8::Isolate* isolate = v8::Isolate::GetCurrent();
     Local<Context> currentContext = isolate->GetCurrentContext();
-    Local<FunctionTemplate> lCallTemplate = Local<FunctionTemplate>::New(isolate, gCallTemplate);
-    Local<Function> function = lCallTemplate->GetFunction(currentContext).ToLocalChecked();
+    Local<Function> function = Local<Function>::New(isolate, gCallFunction);
     Local<Object> callObject = function->NewInstance(currentContext).ToLocalChecked();
     return callObject;
 }
@@ -74,6 +90,16 @@ LS2Call::LS2Call()
     , fToken(LSMESSAGE_TOKEN_INVALID)
     , fResponseLimit(1)
     , fResponseCount(0)
+    , fTimer(0)
+    , fShared(false)
+    , fReplayPending(false)
+    , fRetryTimer(0)
+    , fAttempts(0)
+    , fRetries(0)
+    , fPaused(false)
+    , fMaxDepth(0)
+    , fOverflowPolicy(kDropOldest)
+    , fDropped(0)
 {
     if (fHandle) {
         fHandle->CallCreated(this);
@@ -92,15 +118,55 @@ void LS2Call::SetHandle(LS2Handle* handle)
 }
 
 
-void LS2Call::Call(const char* busName, const char* payload, int responseLimit, const char* sessionId)
+void LS2Call::Call(const char* busName, const char* payload, int responseLimit, const char* sessionId,
+                   const LS2CallOptions* options)
 {
     RequireHandle();
     fResponseLimit = responseLimit;
     fToken = LSMESSAGE_TOKEN_INVALID;
+    // Armed first, so that no response can beat it. The timer only fires on a
+    // later turn of the loop, by which time the call is made or has thrown.
+    if (options && options->fTimeout) {
+        fTimer = LS2TimerWheel::Current()->Add(options->fTimeout, Serial(), kDeadlineCookie);
+    }
+    try {
+        if (options && options->fShared) {
+            LSMessage* last;
+            fToken = fHandle->JoinSharedSubscription(busName, payload, Serial(), &last);
+            fShared = true;
+            if (last) {
+                // Late joiners start from the latest update, once they had a
+                // chance to add their listeners
+                fReplayPending = true;
+                DeliverLater(kReplayMessage, last);
+            }
+        } else {
+            Send(busName, payload, sessionId);
+            if (options && options->fRetry) {
+                // Kept to make the call again
+                fRetry = options->fRetry;
+                fBusName = busName;
+                fPayload = payload ? payload : "";
+                fSessionId = sessionId ? sessionId : "";
+            }
+        }
+    } catch( ... ) {
+        if (fTimer) {
+            LS2TimerWheel::Current()->Cancel(fTimer);
+            fTimer = 0;
+        }
+        throw;
+    }
+    fAttempts = 1;
+    Ref();
+}
+
+void LS2Call::Send(const char* busName, const char* payload, const char* sessionId)
+{
     LSErrorWrapper err;
     bool result = true;
     void* userData((void*)this);
-    if (responseLimit == 1) {
+    if (fResponseLimit == 1) {
         if (sessionId == NULL)
             result = LSCallOneReply(fHandle->Get(), busName, payload, &LS2Call::ResponseCallback, userData, &fToken, err);
         else {
@@ -126,7 +192,107 @@ void LS2Call::Call(const char* busName, const char* payload, int responseLimit,
     if (!result) {
         err.ThrowError();
     }
+}
+
+// The deadline given to Call() passed before the call completed, or the backoff
+// delay before the next attempt is over
+void LS2Call::TimerExpired(uint64_t cookie)
+{
+    if (cookie == kRetryCookie) {
+        fRetryTimer = 0;
+        return Retry();
+    }
+    fTimer = 0;
+    LSMessageToken token = fToken;
+    fToken = LSMESSAGE_TOKEN_INVALID;
+    // Kept alive until the error response is out, as canceling drops the
+    // reference of the call
     Ref();
+    if (fRetryTimer) {
+        // Out of time between two attempts
+        LS2TimerWheel::Current()->Cancel(fRetryTimer);
+        fRetryTimer = 0;
+        Unref();
+    } else {
+        CancelInternal(token, false, false);
+    }
+    EmitError("timeout", "Call timed out", token);
+    Unref();
+}
+
+// Ends the call with an error response made up here rather than sent by the
+// bus, through the same events as one that was
+void LS2Call::EmitError(const char* method, const char* errorText, LSMessageToken token)
+{
+    v8::Isolate* isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> payload = Object::New(isolate);
+    payload->Set(context, String::NewFromUtf8(isolate, "returnValue").ToLocalChecked(),
+                 Boolean::New(isolate, false)).Check();
+    payload->Set(context, String::NewFromUtf8(isolate, "errorCode").ToLocalChecked(),
+                 Integer::New(isolate, -1)).Check();
+    payload->Set(context, String::NewFromUtf8(isolate, "errorText").ToLocalChecked(),
+                 String::NewFromUtf8(isolate, errorText).ToLocalChecked()).Check();
+    String::Utf8Value json(isolate, JSON::Stringify(context, payload).ToLocalChecked());
+
+    Local<Value> messageObject = LS2Message::NewForError(method, *json, token);
+    fResponseCount++;
+    if (fPaused) {
+        // Nothing comes after it, so it waits behind the queued responses
+        if (fQueue.empty()) {
+            Ref();
+        }
+        fQueuedError.Reset(isolate, messageObject);
+        return;
+    }
+    EmitOrBatchMessage(Local<String>::New(isolate, response_symbol),
+                       Local<String>::New(isolate, responses_symbol), messageObject);
+}
+
+// Makes the call again after a retryable error
+void LS2Call::Retry()
+{
+    fAttempts++;
+    fResponseCount = 0;
+    try {
+        RequireHandle();
+        Send(fBusName.c_str(), fPayload.c_str(), fSessionId.empty() ? NULL : fSessionId.c_str());
+    } catch( std::exception const & ex ) {
+        // The call ends here: it gets the error of the last attempt, with what
+        // kept it from being made again
+        fToken = LSMESSAGE_TOKEN_INVALID;
+        if (fTimer) {
+            LS2TimerWheel::Current()->Cancel(fTimer);
+            fTimer = 0;
+        }
+        EmitError(fLastError.c_str(), ex.what(), LSMESSAGE_TOKEN_INVALID);
+        Unref();
+    }
+}
+
+// True, after scheduling the next attempt, when the error ends this attempt
+// but not the call
+bool LS2Call::ScheduleRetry(LSMessage *message)
+{
+    if (!fRetry || !fRetry->IsRetryable(LSMessageGetMethod(message))) {
+        return false;
+    }
+    if (fAttempts >= fRetry->fMaxAttempts) {
+        if (fHandle) {
+            fHandle->CountRetry(true);
+        }
+        return false;
+    }
+    // The bus has ended the failed attempt, so its reference is kept for the next
+    fToken = LSMESSAGE_TOKEN_INVALID;
+    fLastError = LSMessageGetMethod(message) ? LSMessageGetMethod(message) : "";
+    fRetries++;
+    if (fHandle) {
+        fHandle->CountRetry(false);
+    }
+    fRetryTimer = LS2TimerWheel::Current()->Add(fRetry->Delay(fAttempts), Serial(), kRetryCookie);
+    return true;
 }
 
 // Called by V8 when the "Call" function is used with new.
@@ -154,6 +320,21 @@ void LS2Call::Cancel()
 {
     CancelInternal(fToken, true, false);
     fToken = LSMESSAGE_TOKEN_INVALID;
+    ClearQueue();
+}
+
+// Drops the responses held while paused, and the reference they kept
+void LS2Call::ClearQueue()
+{
+    if (!HasQueued()) {
+        return;
+    }
+    for (size_t i = 0; i < fQueue.size(); ++i) {
+        LSMessageUnref(fQueue[i]);
+    }
+    fQueue.clear();
+    fQueuedError.Reset();
+    Unref();
 }
 
 void LS2Call::SetResponseTimeoutWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
@@ -169,6 +350,11 @@ void LS2Call::SetResponseTimeout(int timeout_ms)
 	}
 }
 
+void LS2Call::SetBatchingWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    VoidMemberFunctionWrapper<LS2Call, bool>(static_cast<void (LS2Call::*)(bool)>(&LS2Call::SetBatching), args);
+}
+
 LS2Call::~LS2Call()
 {
 #if TRACE_DESTRUCTORS
@@ -178,12 +364,27 @@ LS2Call::~LS2Call()
         fHandle->CallCompleted(this);
         CancelInternal(fToken, false, false);
     }
+    for (size_t i = 0; i < fQueue.size(); ++i) {
+        LSMessageUnref(fQueue[i]);
+    }
 }
 
 bool LS2Call::ResponseCallback(LSHandle*, LSMessage *message, void *ctx)
 {
     LS2Call* c = static_cast<LS2Call*>(ctx);
-    return c->ResponseArrived(message);
+    return c->Deliver(kResponseMessage, message);
+}
+
+bool LS2Call::MessageArrived(MessageKind kind, LSMessage *message)
+{
+    if (kind == kReplayMessage) {
+        // Superseded by a live update, or canceled in the meantime
+        if (!fReplayPending || fToken == LSMESSAGE_TOKEN_INVALID) {
+            return true;
+        }
+    }
+    fReplayPending = false;
+    return ResponseArrived(message);
 }
 
 bool LS2Call::ResponseArrived(LSMessage *message)
@@ -191,22 +392,206 @@ bool LS2Call::ResponseArrived(LSMessage *message)
     v8::Isolate* isolate = Isolate::GetCurrent();
     HandleScope scope(isolate);
 
-    fResponseCount+=1;
-    EmitMessage(Local<String>::New(isolate, response_symbol), message);
     const char* category = LSMessageGetCategory(message);
     bool messageInErrorCategory = (category && strcmp(LUNABUS_ERROR_CATEGORY, category) == 0);
-    if (messageInErrorCategory || (fResponseLimit != kUnlimitedResponses && fResponseCount >= fResponseLimit)) {
+    if (messageInErrorCategory && !fShared && ScheduleRetry(message)) {
+        return true;
+    }
+
+    fResponseCount+=1;
+    bool ending = messageInErrorCategory || (fResponseLimit != kUnlimitedResponses && fResponseCount >= fResponseLimit);
+    if (fPaused) {
+        QueueResponse(message, ending);
+    } else {
+        EmitResponse(message);
+    }
+    if (ending) {
         CancelInternal(fToken, false, messageInErrorCategory);
         fToken = LSMESSAGE_TOKEN_INVALID;
     }
     return true;
 }
 
+void LS2Call::EmitResponse(LSMessage *message)
+{
+    v8::Isolate* isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+    EmitOrBatchMessage(Local<String>::New(isolate, response_symbol),
+                       Local<String>::New(isolate, responses_symbol), message);
+}
+
+void LS2Call::QueueResponse(LSMessage *message, bool ending)
+{
+    bool full = (fOverflowPolicy == kKeepLatest) ? !fQueue.empty()
+                                                 : (fMaxDepth && fQueue.size() >= fMaxDepth);
+    // The response that ends the call is always kept, so that the consumer
+    // learns it ended; with kDropNewest it evicts the oldest one instead
+    if (full && fOverflowPolicy == kDropNewest && !ending) {
+        fDropped++;
+        return;
+    }
+    if (fQueue.empty()) {
+        // Stay alive while responses are queued, even after the last expected one
+        Ref();
+    }
+    LSMessageRef(message);
+    fQueue.push_back(message);
+    if (full) {
+        // kDropOldest makes room for the new response, kKeepLatest keeps it only
+        size_t depth = (fOverflowPolicy == kKeepLatest) ? 1 : fMaxDepth;
+        while (fQueue.size() > depth) {
+            LSMessageUnref(fQueue.front());
+            fQueue.pop_front();
+            fDropped++;
+        }
+    }
+}
+
+void LS2Call::PauseWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    VoidMemberFunctionWrapper<LS2Call>(&LS2Call::Pause, args);
+}
+
+void LS2Call::ResumeWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    VoidMemberFunctionWrapper<LS2Call>(&LS2Call::Resume, args);
+}
+
+void LS2Call::PullWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    MemberFunctionWrapper<LS2Call, uint32_t, int>(&LS2Call::Pull, args);
+}
+
+void LS2Call::SetQueueLimitWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    VoidMemberFunctionWrapper<LS2Call, int, const char*>(&LS2Call::SetQueueLimit, args);
+}
+
+void LS2Call::GetQueueStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    MemberFunctionWrapper<LS2Call, Local<Value> >(&LS2Call::GetQueueStats, args);
+}
+
+// Responses arriving from now on are queued until resume() or pull()
+void LS2Call::Pause()
+{
+    fPaused = true;
+}
+
+// Emits the queued responses, unless a listener pauses again, and goes back to
+// emitting responses as they arrive
+void LS2Call::Resume()
+{
+    fPaused = false;
+    while (!fPaused && HasQueued()) {
+        EmitQueued(1);
+    }
+    // Called from JS, not from a dispatch cycle that would emit the batch
+    FlushBatches();
+}
+
+// Emits up to count queued responses, returns how many were emitted
+uint32_t LS2Call::Pull(int count)
+{
+    uint32_t emitted = EmitQueued(count);
+    FlushBatches();
+    return emitted;
+}
+
+uint32_t LS2Call::EmitQueued(int count)
+{
+    uint32_t emitted = 0;
+    while (count-- > 0 && HasQueued()) {
+        emitted++;
+        if (fQueue.empty()) {
+            // The error that ended the call comes last
+            v8::Isolate* isolate = Isolate::GetCurrent();
+            HandleScope scope(isolate);
+            Local<Value> messageObject = fQueuedError.Get(isolate);
+            fQueuedError.Reset();
+            Unref();
+            EmitOrBatchMessage(Local<String>::New(isolate, response_symbol),
+                               Local<String>::New(isolate, responses_symbol), messageObject);
+            continue;
+        }
+        LSMessage* message = fQueue.front();
+        fQueue.pop_front();
+        if (!HasQueued()) {
+            Unref();
+        }
+        EmitResponse(message);
+        LSMessageUnref(message);
+    }
+    return emitted;
+}
+
+void LS2Call::SetQueueLimit(int maxDepth, const char* policy)
+{
+    if (maxDepth < 0) {
+        throw runtime_error("Queue depth must not be negative");
+    }
+    if (!policy || strcmp(policy, "dropOldest") == 0) {
+        fOverflowPolicy = kDropOldest;
+    } else if (strcmp(policy, "dropNewest") == 0) {
+        fOverflowPolicy = kDropNewest;
+    } else if (strcmp(policy, "latest") == 0) {
+        fOverflowPolicy = kKeepLatest;
+    } else {
+        throw runtime_error("Unknown overflow policy");
+    }
+    fMaxDepth = maxDepth;
+}
+
+Local<Value> LS2Call::GetQueueStats() const
+{
+    v8::Isolate* isolate = Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> result = Object::New(isolate);
+    result->Set(context, String::NewFromUtf8(isolate, "paused").ToLocalChecked(),
+                Boolean::New(isolate, fPaused)).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "queued").ToLocalChecked(),
+                Number::New(isolate, fQueue.size() + (fQueuedError.IsEmpty() ? 0 : 1))).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "dropped").ToLocalChecked(),
+                Number::New(isolate, fDropped)).Check();
+    return result;
+}
+
+void LS2Call::GetRetryStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    MemberFunctionWrapper<LS2Call, Local<Value> >(&LS2Call::GetRetryStats, args);
+}
+
+Local<Value> LS2Call::GetRetryStats() const
+{
+    v8::Isolate* isolate = Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> result = Object::New(isolate);
+    result->Set(context, String::NewFromUtf8(isolate, "attempts").ToLocalChecked(),
+                Number::New(isolate, fAttempts)).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "retries").ToLocalChecked(),
+                Number::New(isolate, fRetries)).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "waiting").ToLocalChecked(),
+                Boolean::New(isolate, fRetryTimer != 0)).Check();
+    return result;
+}
+
 void LS2Call::CancelInternal(LSMessageToken token, bool shouldThrow, bool cancelDueToError)
 {
+    if (fTimer) {
+        LS2TimerWheel::Current()->Cancel(fTimer);
+        fTimer = 0;
+    }
+    if (fRetryTimer) {
+        // Waiting to make the call again; there is nothing on the bus to cancel
+        LS2TimerWheel::Current()->Cancel(fRetryTimer);
+        fRetryTimer = 0;
+        Unref();
+        return;
+    }
     if (token == LSMESSAGE_TOKEN_INVALID) {
         return;
     }
+    BusLock lock;
     if (shouldThrow) {
         RequireHandle();
     } else if (fHandle == 0 || !fHandle->IsValid()) {
@@ -215,6 +600,12 @@ void LS2Call::CancelInternal(LSMessageToken token, bool shouldThrow, bool cancel
     }
     Unref();
 
+    if (fShared) {
+        fShared = false;
+        fHandle->LeaveSharedSubscription(token, Serial());
+        return;
+    }
+
     // If the message was from the bus, no reason to cancel
     if (cancelDueToError) {
         return;
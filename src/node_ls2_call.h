@@ -18,11 +18,23 @@
 #define NODE_LS2_CALL_H
 
 #include "node_ls2_base.h"
+#include "node_ls2_retry_policy.h"
 
+#include <deque>
+#include <memory>
 #include <string>
 
 class LS2Handle;
 
+// Options of a call, subscribe or watch
+struct LS2CallOptions {
+    LS2CallOptions() : fTimeout(0), fShared(false) {}
+
+    unsigned fTimeout;  // ms, 0 for none
+    bool fShared;       // join the handle's shared subscription
+    std::shared_ptr<const LS2RetryPolicy> fRetry;
+};
+
 class LS2Call : public LS2Base {
 public:
     enum {kUnlimitedResponses = 0};
@@ -37,7 +49,11 @@ public:
 
     void SetHandle(LS2Handle* handle);
 
-    void Call(const char* busName, const char* payload, int responseLimit, const char* sessionId = NULL);
+    void Call(const char* busName, const char* payload, int responseLimit, const char* sessionId = NULL,
+              const LS2CallOptions* options = NULL);
+
+    virtual bool MessageArrived(MessageKind kind, LSMessage *message);
+    virtual void TimerExpired(uint64_t cookie);
 
 protected:
 	// Called by V8 when the "Call" function is used with new. This has to be here, but the
@@ -46,13 +62,42 @@ protected:
 
     static void CancelWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
 	static void SetResponseTimeoutWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	static void SetBatchingWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
     void Cancel();
 	void SetResponseTimeout(int timeout_ms);
 
+	static void PauseWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	static void ResumeWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	static void PullWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	static void SetQueueLimitWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	static void GetQueueStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	void Pause();
+	void Resume();
+	uint32_t Pull(int count);
+	void SetQueueLimit(int maxDepth, const char* policy);
+	v8::Local<v8::Value> GetQueueStats() const;
+
+	static void GetRetryStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	v8::Local<v8::Value> GetRetryStats() const;
+
 private:
 	virtual ~LS2Call();
 	static bool ResponseCallback(LSHandle *sh, LSMessage *message, void *ctx);
 	bool ResponseArrived(LSMessage *message);
+
+	// Makes the LS2 call, setting fToken
+	void Send(const char* busName, const char* payload, const char* sessionId);
+	bool ScheduleRetry(LSMessage *message);
+	void Retry();
+	void EmitResponse(LSMessage *message);
+	void EmitError(const char* method, const char* errorText, LSMessageToken token);
+
+	// Queues a response while paused, applying the overflow policy. ending is
+	// set for the response that ends the call.
+	void QueueResponse(LSMessage *message, bool ending);
+	void ClearQueue();
+	uint32_t EmitQueued(int count);
+	bool HasQueued() const { return !fQueue.empty() || !fQueuedError.IsEmpty(); }
     void CancelInternal(LSMessageToken token, bool shouldThrow, bool cancelDueToError);
 
 	// Throws an exception if fHandle or fToken are invalid.
@@ -66,8 +111,42 @@ private:
     LSMessageToken fToken;
     int fResponseLimit;
     int fResponseCount;
+    // Cookies of the timers in the LS2TimerWheel
+    enum {
+        kDeadlineCookie = 1,
+        kRetryCookie
+    };
+    uint64_t fTimer;   // the deadline, or 0
+    bool fShared;      // fToken is a subscription shared through the handle
+    bool fReplayPending;
+
+    // Retrying failed attempts; fToken is invalid while fRetryTimer runs
+    std::shared_ptr<const LS2RetryPolicy> fRetry;
+    std::string fBusName;
+    std::string fPayload;
+    std::string fSessionId;
+    uint64_t fRetryTimer;
+    std::string fLastError;  // method of the error that ended the last attempt
+    int fAttempts;
+    int fRetries;
+
+    // What to do with a response arriving while the queue is full
+    enum OverflowPolicy {
+        kDropOldest,
+        kDropNewest,
+        kKeepLatest    // the queue holds the newest response only
+    };
+
+    // Responses held while paused, each with a reference taken
+    bool fPaused;
+    std::deque<LSMessage*> fQueue;
+    v8::Global<v8::Value> fQueuedError;  // from EmitError(), emitted after fQueue
+    size_t fMaxDepth;  // 0 is unlimited
+    OverflowPolicy fOverflowPolicy;
+    uint64_t fDropped;
     
-    static v8::Persistent<v8::FunctionTemplate> gCallTemplate;
+    static thread_local v8::Persistent<v8::FunctionTemplate> gCallTemplate;
+    static thread_local v8::Persistent<v8::Function> gCallFunction;
 };
 
 #endif
@@ -19,6 +19,8 @@
 #include "node_ls2_handle.h"
 #include "node_ls2_message.h"
 #include "node_ls2_call.h"
+#include "node_ls2_publisher.h"
+#include "node_ls2_timer_wheel.h"
 #include "node_ls2_utils.h"
 
 #include <syslog.h>
@@ -28,16 +30,30 @@
 #include <cstring>
 #include <sstream>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
 #include <unistd.h>
 
 using namespace std;
 using namespace v8;
 using namespace node;
 
-static Persistent<String> cancel_symbol;
-static Persistent<String> request_symbol;
+// Per environment, as each worker has its own isolate
+static thread_local Persistent<String> cancel_symbol;
+static thread_local Persistent<String> request_symbol;
+static thread_local Persistent<String> requests_symbol;
 
+// Per environment
+thread_local std::unordered_map<LSMessage*, LS2Handle::AdmissionTicket> LS2Handle::tAdmittedRequests;
+
+// Shared by all environments in the process
 LS2Handle::ServiceContainer LS2Handle::fRegisteredServices;
+LS2Handle::ServiceContainer LS2Handle::fScriptAppIds;
+std::mutex LS2Handle::fRegisteredServicesMutex;
+
+// Above this many cached callAsync() responses, expired ones are swept out
+static const size_t kMaxCachedResponses = 256;
 
 static std::set<std::string> trustedScripts = {
 #include "trusted_scripts.inc"
@@ -59,18 +75,40 @@ void LS2Handle::Initialize(Local<Object> target, v8::Local<v8::Context> context)
     t->InstanceTemplate()->SetInternalFieldCount(1);
 
     NODE_SET_PROTOTYPE_METHOD(t, "call", CallWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "callAsync", CallAsyncWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "callMany", CallManyWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "setCallCacheTTL", SetCallCacheTTLWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "invalidateCallCache", InvalidateCallCacheWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "getCallCacheStats", GetCallCacheStatsWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "waitForService", WaitForServiceWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "onServiceStatus", OnServiceStatusWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "offServiceStatus", OffServiceStatusWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "getServiceStatus", GetServiceStatusWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "callSession", CallSessionWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "watch", WatchWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "subscribe", SubscribeWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "subscribeSession", SubscribeSessionWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "registerMethod", RegisterMethodWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "registerMethods", RegisterMethodsWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "subscriptionAdd", SubscriptionAddWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "subscriptionReply", SubscriptionReplyWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "subscriberCount", SubscriberCountWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "publish", PublishWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "setPublishInterval", SetPublishIntervalWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "getPublishStats", GetPublishStatsWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "cancel", CancelWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "pushRole", PushRoleWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "setPriority", SetPriorityWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "setBatching", SetBatchingWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "setRetryPolicy", SetRetryPolicyWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "setAdmissionLimit", SetAdmissionLimitWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "getAdmissionStats", GetAdmissionStatsWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "getRetryStats", GetRetryStatsWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "unregister", UnregisterWrapper);
 
     cancel_symbol.Reset(isolate, String::NewFromUtf8(isolate, "cancel").ToLocalChecked());
     request_symbol.Reset(isolate, String::NewFromUtf8(isolate, "request").ToLocalChecked());
+    requests_symbol.Reset(isolate, String::NewFromUtf8(isolate, "requests").ToLocalChecked());
 
     target->Set(currentContext, String::NewFromUtf8(isolate, "Handle").ToLocalChecked(), t->GetFunction(currentContext).ToLocalChecked());
     NODE_SET_METHOD(target, "setAppId", LS2Handle::SetAppId);
@@ -141,6 +179,14 @@ void LS2Handle::New(const v8::FunctionCallbackInfo<v8::Value>& args)
 
 LS2Handle::LS2Handle(LSHandle* handle)
     : fHandle(handle)
+    , fNextWaiterId(1)
+    , fNextRequestId(1)
+    , fNextAdmissionEpoch(1)
+    , fRetries(0)
+    , fRetriesExhausted(0)
+    , fCacheHits(0)
+    , fCacheMisses(0)
+    , fCacheCoalesced(0)
 {
     LSErrorWrapper err;
 
@@ -157,7 +203,7 @@ LS2Handle::~LS2Handle()
     cerr << "LS2Handle::~LS2Handle()" << endl;
 #endif
 	// This should never happen, since the destructor won't get called when we still have registered methods
-	if (fRegisteredMethods.size() > 0) {
+	if (!fCategories.empty()) {
 		cerr << "LS2Handle::~LS2Handle() called with registered methods active" << endl;
 		this->Unregister();
 	}
@@ -165,6 +211,9 @@ LS2Handle::~LS2Handle()
 
 void LS2Handle::CallWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
+    if (args.Length() == 3) {
+        return CallWithOptions(args, 1);
+    }
     MemberFunctionWrapper<LS2Handle, Local<Value>, const char*, const char*>(&LS2Handle::Call, args);
 }
 
@@ -185,6 +234,9 @@ Local<Value> LS2Handle::CallSession(const char* busName, const char* payload, co
 
 void LS2Handle::WatchWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
+    if (args.Length() == 3) {
+        return CallWithOptions(args, 2);
+    }
     MemberFunctionWrapper<LS2Handle, Local<Value>, const char*, const char*>(&LS2Handle::Watch, args);
 }
 
@@ -195,6 +247,9 @@ Local<Value> LS2Handle::Watch(const char* busName, const char* payload)
 
 void LS2Handle::SubscribeWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
+    if (args.Length() == 3) {
+        return CallWithOptions(args, LS2Call::kUnlimitedResponses);
+    }
     MemberFunctionWrapper<LS2Handle, Local<Value>, const char*, const char*>(&LS2Handle::Subscribe, args);
 }
 
@@ -203,6 +258,46 @@ Local<Value> LS2Handle::Subscribe(const char* busName, const char* payload)
     return CallInternal(busName, payload, LS2Call::kUnlimitedResponses);
 }
 
+// call(), watch() and subscribe() with a trailing {timeoutMs, deadline} object
+void LS2Handle::CallWithOptions(const v8::FunctionCallbackInfo<v8::Value>& args, int responseLimit)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    try {
+        LS2Handle* h = node::ObjectWrap::Unwrap<LS2Handle>(args.This());
+        if (!h) {
+            throw std::runtime_error("Unable to unwrap native object.");
+        }
+        ConvertFromJS<const char*> busName(args[0]);
+        ConvertFromJS<const char*> payload(args[1]);
+        LS2CallOptions callOptions;
+        callOptions.fRetry = h->fRetryPolicy;
+        if (!args[2]->IsUndefined()) {
+            if (!args[2]->IsObject()) {
+                throw std::runtime_error("Call options must be an object");
+            }
+            Local<Object> options = Local<Object>::Cast(args[2]);
+            Local<Context> context = isolate->GetCurrentContext();
+            callOptions.fTimeout = ReadTimeout(options);
+            if (responseLimit == LS2Call::kUnlimitedResponses) {
+                callOptions.fShared = options->Get(context,
+                        String::NewFromUtf8(isolate, "shared").ToLocalChecked()).ToLocalChecked()->BooleanValue(isolate);
+            }
+            Local<Value> retry = options->Get(context, String::NewFromUtf8(isolate, "retry").ToLocalChecked()).ToLocalChecked();
+            if (!retry->IsUndefined()) {
+                callOptions.fRetry = LS2RetryPolicy::FromJS(retry);
+            }
+        }
+        args.GetReturnValue().Set(h->CallInternal(busName.value(), payload.value(), responseLimit, NULL,
+                                                  &callOptions));
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
+    }
+}
+
 void LS2Handle::SubscribeSessionWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
     MemberFunctionWrapper<LS2Handle, Local<Value>, const char*, const char*>(&LS2Handle::SubscribeSession, args);
@@ -228,6 +323,63 @@ bool LS2Handle::Cancel(LSMessageToken t)
     return true;
 }
 
+void LS2Handle::SetRetryPolicyWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    VoidMemberFunctionWrapper<LS2Handle, Local<Value> >(&LS2Handle::SetRetryPolicy, args);
+}
+
+// The policy of calls made without a retry option from now on
+void LS2Handle::SetRetryPolicy(Local<Value> policy)
+{
+    fRetryPolicy = policy->IsUndefined() ? std::shared_ptr<const LS2RetryPolicy>()
+                                         : LS2RetryPolicy::FromJS(policy);
+}
+
+void LS2Handle::GetRetryStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    MemberFunctionWrapper<LS2Handle, Local<Value> >(&LS2Handle::GetRetryStats, args);
+}
+
+Local<Value> LS2Handle::GetRetryStats()
+{
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> result = Object::New(isolate);
+    result->Set(context, String::NewFromUtf8(isolate, "retries").ToLocalChecked(),
+                Number::New(isolate, fRetries)).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "exhausted").ToLocalChecked(),
+                Number::New(isolate, fRetriesExhausted)).Check();
+    return result;
+}
+
+void LS2Handle::CountRetry(bool exhausted)
+{
+    if (exhausted) {
+        fRetriesExhausted++;
+    } else {
+        fRetries++;
+    }
+}
+
+void LS2Handle::SetPriorityWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    VoidMemberFunctionWrapper<LS2Handle, int>(&LS2Handle::SetPriority, args);
+}
+
+void LS2Handle::SetPriority(int priority)
+{
+    RequireHandle();
+    LSErrorWrapper err;
+    if(!LSGmainSetPriority(fHandle, priority, err)) {
+        err.ThrowError();
+    }
+}
+
+void LS2Handle::SetBatchingWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    VoidMemberFunctionWrapper<LS2Handle, bool>(static_cast<void (LS2Handle::*)(bool)>(&LS2Handle::SetBatching), args);
+}
+
 void LS2Handle::PushRoleWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
     VoidMemberFunctionWrapper<LS2Handle, const char*>(&LS2Handle::PushRole, args);
@@ -242,22 +394,121 @@ void LS2Handle::PushRole(const char* pathToRoleFile)
     }
 }
 
+// registerMethod(category, method, [handler]). Not a VoidMemberFunctionWrapper, as
+// the handler is optional.
 void LS2Handle::RegisterMethodWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
-    VoidMemberFunctionWrapper<LS2Handle, const char*, const char*>(&LS2Handle::RegisterMethod, args);
+    v8::Isolate* isolate = args.GetIsolate();
+    try {
+        if (args.Length() != 2 && args.Length() != 3) {
+            throw std::runtime_error("Invalid number of parameters");
+        }
+        LS2Handle* h = node::ObjectWrap::Unwrap<LS2Handle>(args.This());
+        if (!h) {
+            throw std::runtime_error("Unable to unwrap native object.");
+        }
+        ConvertFromJS<const char*> category(args[0]);
+        ConvertFromJS<const char*> methodName(args[1]);
+        Local<Function> handler;
+        if (args.Length() == 3 && !args[2]->IsUndefined()) {
+            if (!args[2]->IsFunction()) {
+                throw std::runtime_error("Method handler must be a function");
+            }
+            handler = Local<Function>::Cast(args[2]);
+        }
+        h->RegisterMethod(category.value(), methodName.value(), handler);
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
+    }
+}
+
+void LS2Handle::RegisterMethod(const char* category, const char* methodName, Local<Function> handler)
+{
+    RegisterMethods(category, std::vector<std::string>(1, methodName ? methodName : ""),
+                    std::vector<Local<Function> >(1, handler));
+}
+
+// registerMethods(category, methods), where methods is an array of method names or
+// an object mapping method names to handlers
+void LS2Handle::RegisterMethodsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    try {
+        if (args.Length() != 2) {
+            throw std::runtime_error("Invalid number of parameters");
+        }
+        LS2Handle* h = node::ObjectWrap::Unwrap<LS2Handle>(args.This());
+        if (!h) {
+            throw std::runtime_error("Unable to unwrap native object.");
+        }
+        if (!args[1]->IsObject()) {
+            throw std::runtime_error("Methods must be an array or an object");
+        }
+        ConvertFromJS<const char*> category(args[0]);
+        Local<Context> context = isolate->GetCurrentContext();
+        std::vector<std::string> methodNames;
+        std::vector<Local<Function> > handlers;
+
+        if (args[1]->IsArray()) {
+            Local<Array> names = Local<Array>::Cast(args[1]);
+            for (uint32_t i = 0; i < names->Length(); ++i) {
+                ConvertFromJS<std::string> name(names->Get(context, i).ToLocalChecked());
+                methodNames.push_back(name.value());
+                handlers.push_back(Local<Function>());
+            }
+        } else {
+            Local<Object> methods = Local<Object>::Cast(args[1]);
+            Local<Array> names = methods->GetOwnPropertyNames(context).ToLocalChecked();
+            for (uint32_t i = 0; i < names->Length(); ++i) {
+                Local<Value> name = names->Get(context, i).ToLocalChecked();
+                Local<Value> handler = methods->Get(context, name).ToLocalChecked();
+                if (!handler->IsFunction() && !handler->IsUndefined() && !handler->IsNull()) {
+                    throw std::runtime_error("Method handler must be a function");
+                }
+                methodNames.push_back(ConvertFromJS<std::string>(name).value());
+                handlers.push_back(handler->IsFunction() ? Local<Function>::Cast(handler) : Local<Function>());
+            }
+        }
+        h->RegisterMethods(category.value(), methodNames, handlers);
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
+    }
 }
 
-void LS2Handle::RegisterMethod(const char* category, const char* methodName)
+// Registers all the methods with a single LSRegisterCategoryAppend call
+void LS2Handle::RegisterMethods(const char* category, const std::vector<std::string>& methodNames,
+                                const std::vector<Local<Function> >& handlers)
 {
     RequireHandle();
-    if (fRegisteredMethods.size() == 0) {
+    if (methodNames.empty()) {
+        return;
+    }
+    if (fCategories.empty()) {
         // Establish a self-reference on the first method registration so that this object
         // won't get collected.
         Ref();
     }
-    RegisteredMethod* m = new RegisteredMethod(methodName);
-    fRegisteredMethods.push_back(m);
-    RegisterCategory(category, m->GetMethods());
+    LSMethod* methods = fCategories[CategoryName(category)].AddTable(methodNames);
+    RegisterCategory(category, methods);
+
+    // Only once registered, and a method registered again without a handler
+    // goes back to emitting the 'request' event
+    for (size_t i = 0; i < handlers.size(); ++i) {
+        std::string key = MethodKey(category, methodNames[i].c_str());
+        if (handlers[i].IsEmpty()) {
+            fMethodHandlers.erase(key);
+        } else {
+            fMethodHandlers[key].Reset(Isolate::GetCurrent(), handlers[i]);
+        }
+    }
 }
 
 void LS2Handle::UnregisterWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
@@ -268,6 +519,8 @@ void LS2Handle::UnregisterWrapper(const v8::FunctionCallbackInfo<v8::Value>& arg
 void LS2Handle::Unregister()
 {
     //cerr << "LS2Handle::Unregister()" << endl;
+    BusLock lock;
+    CancelServiceWatches("Handle unregistered");
     if (fHandle) {
         LSErrorWrapper err;
         if(!LSUnregister(fHandle, err)) {
@@ -277,20 +530,21 @@ void LS2Handle::Unregister()
         }
 	fHandle = 0;
     }
-    if (fRegisteredMethods.size() > 0) {
+    if (fPublisher) {
+        fPublisher->Cancel();
+    }
+    RejectPendingCalls("Handle unregistered");
+    ForgetSharedSubscriptions();
+    DropQueuedRequests();
+    if (!fCategories.empty()) {
         // Undo the Ref() operation from the first registerMethod() - this object is now eligible for collection
         Unref();
     }
-    // I wish I had boost and could use shared_ptr here.
-    for(MethodVector::const_iterator i = fRegisteredMethods.begin(); i != fRegisteredMethods.end(); ++i) {
-        RegisteredMethod* m = *i;
-        delete m;
-    }
 
-    // Since we've deleted all of the items above, make sure we
-    // clean up the vector as well (make size == 0) so that if this gets
-    // called again for some reason we won't attempt to double-free
-    fRegisteredMethods.clear();
+    // Clear the map, so that if this gets called again for some reason we won't
+    // Unref() twice
+    fCategories.clear();
+    fMethodHandlers.clear();
 }
 
 void LS2Handle::SubscriptionAddWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
@@ -307,172 +561,1914 @@ void LS2Handle::SubscriptionAdd(const char* key, LS2Message* msg)
     }
 }
 
-Local<Value> LS2Handle::CallInternal(const char* busName, const char* payload, int responseLimit, const char* sessionId)
+void LS2Handle::SubscriptionReplyWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
-    RequireHandle();
-    Local<Object> callObject = LS2Call::NewForCall();
-    LS2Call *call = node::ObjectWrap::Unwrap<LS2Call>(callObject);
-    if (!call) {
-        v8::Isolate* isolate = v8::Isolate::GetCurrent();
-        return isolate->ThrowException(
-                v8::String::NewFromUtf8(isolate, "Unable to unwrap native object.").ToLocalChecked());
-    }
-    call->SetHandle(this);
-    if (sessionId != NULL)
-        call->Call(busName, payload, responseLimit, sessionId);
-    else
-        call->Call(busName, payload, responseLimit);
-    return callObject;
+    VoidMemberFunctionWrapper<LS2Handle, const char*, const char*>(&LS2Handle::SubscriptionReply, args);
 }
 
-void LS2Handle::Attach(GMainLoop *mainLoop)
+// Responds to every subscriber of key, in one call. LS2 drops subscribers whose
+// subscription was canceled, so they are never replied to.
+void LS2Handle::SubscriptionReply(const char* key, const char* payload)
 {
+    RequireHandle();
+    if (!key || !payload) {
+        throw runtime_error("Subscription key and payload are required");
+    }
     LSErrorWrapper err;
-    if(!LSGmainAttach(fHandle, mainLoop, err)) {
+    if(!LSSubscriptionReply(fHandle, key, payload, err)) {
         err.ThrowError();
     }
 }
 
-bool LS2Handle::RegisterCategory(const char* categoryName, LSMethod *methods)
+void LS2Handle::SubscriberCountWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
-    LSErrorWrapper err;
-    const char* catName = "/";
-    if (strlen(categoryName) > 0) {
-        catName = categoryName;
+    MemberFunctionWrapper<LS2Handle, uint32_t, const char*>(&LS2Handle::SubscriberCount, args);
+}
+
+uint32_t LS2Handle::SubscriberCount(const char* key)
+{
+    RequireHandle();
+    if (!key) {
+        throw runtime_error("Subscription key is required");
     }
+    return LSSubscriptionGetHandleSubscribersCount(fHandle, key);
+}
 
-    if(!LSRegisterCategoryAppend(fHandle, catName, methods, 0, err)) {
-        err.ThrowError();
+void LS2Handle::PublishWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    VoidMemberFunctionWrapper<LS2Handle, const char*, const char*>(&LS2Handle::Publish, args);
+}
+
+// Like subscriptionReply, but coalesced as set with setPublishInterval
+void LS2Handle::Publish(const char* key, const char* payload)
+{
+    RequireHandle();
+    if (!key || !payload) {
+        throw runtime_error("Subscription key and payload are required");
     }
+    Publisher()->Publish(key, payload);
+}
 
-    if(!LSCategorySetData(fHandle, catName, static_cast<void*>(this), err)) {
-        err.ThrowError();
+void LS2Handle::SetPublishIntervalWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    VoidMemberFunctionWrapper<LS2Handle, int>(&LS2Handle::SetPublishInterval, args);
+}
+
+void LS2Handle::SetPublishInterval(int interval)
+{
+    RequireHandle();
+    if (interval < 0) {
+        throw runtime_error("Publish interval must not be negative");
     }
+    Publisher()->SetInterval(interval);
+}
 
-    return true;
+void LS2Handle::GetPublishStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    MemberFunctionWrapper<LS2Handle, Local<Value> >(&LS2Handle::GetPublishStats, args);
 }
 
-bool LS2Handle::CancelCallback(LSHandle *sh, LSMessage *message, void *ctx)
+Local<Value> LS2Handle::GetPublishStats()
 {
-    LS2Handle* h = static_cast<LS2Handle*>(ctx);
-    return h->CancelArrived(message);
+    return Publisher()->Stats(Isolate::GetCurrent());
 }
 
-bool LS2Handle::CancelArrived(LSMessage *message)
+LS2Publisher* LS2Handle::Publisher()
 {
-    v8::Isolate* isolate = v8::Isolate::GetCurrent();
-    HandleScope scope(isolate);
-    //UnrefIfPending(LSMessageGetResponseToken(message));
-    EmitMessage(Local<String>::New(isolate, cancel_symbol), message);
-    return true;
+    if (!fPublisher) {
+        RequireHandle();
+        fPublisher.reset(new LS2Publisher(Isolate::GetCurrent(), fHandle));
+    }
+    return fPublisher.get();
 }
 
-bool LS2Handle::RequestCallback(LSHandle *sh, LSMessage *message, void *ctx)
+// callAsync(uri, payload, [options]). Not a MemberFunctionWrapper, as the options
+// are optional.
+void LS2Handle::CallAsyncWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
-    LS2Handle* h = static_cast<LS2Handle*>(ctx);
-    return h->RequestArrived(message);
+    v8::Isolate* isolate = args.GetIsolate();
+    try {
+        if (args.Length() != 2 && args.Length() != 3) {
+            throw std::runtime_error("Invalid number of parameters");
+        }
+        LS2Handle* h = node::ObjectWrap::Unwrap<LS2Handle>(args.This());
+        if (!h) {
+            throw std::runtime_error("Unable to unwrap native object.");
+        }
+        ConvertFromJS<const char*> busName(args[0]);
+        ConvertFromJS<const char*> payload(args[1]);
+        Local<Object> options;
+        if (args.Length() == 3 && !args[2]->IsUndefined()) {
+            if (!args[2]->IsObject()) {
+                throw std::runtime_error("Call options must be an object");
+            }
+            options = Local<Object>::Cast(args[2]);
+        }
+        args.GetReturnValue().Set(h->CallAsync(busName.value(), payload.value(), options));
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
+    }
 }
 
-bool LS2Handle::RequestArrived(LSMessage *message)
+// Reads timeout (or timeoutMs), a relative limit in milliseconds, and deadline,
+// an absolute time in milliseconds since the epoch as given by Date.now(), and
+// returns whichever comes first as a delay. 0 means no limit.
+unsigned LS2Handle::ReadTimeout(Local<Object> options)
 {
     v8::Isolate* isolate = v8::Isolate::GetCurrent();
-    HandleScope scope(isolate);
-    EmitMessage(Local<String>::New(isolate, request_symbol), message);
-    return true;
+    Local<Context> context = isolate->GetCurrentContext();
+    double timeout = 0;
+    Local<Value> value = options->Get(context, String::NewFromUtf8(isolate, "timeoutMs").ToLocalChecked()).ToLocalChecked();
+    if (value->IsUndefined()) {
+        value = options->Get(context, String::NewFromUtf8(isolate, "timeout").ToLocalChecked()).ToLocalChecked();
+    }
+    if (!value->IsUndefined()) {
+        timeout = value->NumberValue(context).FromJust();
+        if (!(timeout >= 0)) {
+            throw std::runtime_error("Invalid timeout");
+        }
+    }
+    value = options->Get(context, String::NewFromUtf8(isolate, "deadline").ToLocalChecked()).ToLocalChecked();
+    if (!value->IsUndefined()) {
+        double deadline = value->NumberValue(context).FromJust();
+        double now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        if (!(deadline > now)) {
+            throw std::runtime_error("Deadline has already passed");
+        }
+        if (timeout == 0 || deadline - now < timeout) {
+            timeout = deadline - now;
+        }
+    }
+    if (timeout > std::numeric_limits<unsigned>::max()) {
+        timeout = std::numeric_limits<unsigned>::max();
+    }
+    // Round up, so that a fraction of a millisecond left still gets a timer
+    return static_cast<unsigned>(std::ceil(timeout));
 }
 
-void LS2Handle::SetAppId(const v8::FunctionCallbackInfo<v8::Value>& args)
+void LS2Handle::ReadCallOptions(Local<Object> options, unsigned* timeout, bool* parseJSON)
 {
+    *timeout = 0;
+    *parseJSON = false;
+    if (options.IsEmpty()) {
+        return;
+    }
     v8::Isolate* isolate = v8::Isolate::GetCurrent();
-    HandleScope scope(isolate);
+    Local<Context> context = isolate->GetCurrentContext();
+    *timeout = ReadTimeout(options);
+    Local<Value> value = options->Get(context, String::NewFromUtf8(isolate, "json").ToLocalChecked()).ToLocalChecked();
+    *parseJSON = value->BooleanValue(isolate);
+}
 
-    try {
-        if (args.Length() < 2) {
-            throw std::runtime_error("Invalid arguments");
-        }
+LSMessageToken LS2Handle::CallForPromise(const char* busName, const char* payload, int responseLimit, unsigned timeout)
+{
+    LSMessageToken token = LSMESSAGE_TOKEN_INVALID;
+    LSErrorWrapper err;
+    bool result;
+    if (responseLimit == 1) {
+        result = LSCallOneReply(fHandle, busName, payload, &LS2Handle::AsyncResponseCallback,
+                                static_cast<void*>(this), &token, err);
+    } else {
+        result = LSCall(fHandle, busName, payload, &LS2Handle::AsyncResponseCallback,
+                        static_cast<void*>(this), &token, err);
+    }
+    if (!result) {
+        err.ThrowError();
+    }
 
-        ConvertFromJS<const char*> serviceName(args[0]);
-        if (serviceName.value()) {
-            if (strcmp(serviceName.value(), "com.webos.service.jsserver"))
-                checkCallerScriptPermissions(isolate);
-        }
+    if (fPendingCalls.empty()) {
+        Ref();
+    }
+    PendingCall& call = fPendingCalls[token];
+    call.fTimer = timeout ? LS2TimerWheel::Current()->Add(timeout, Serial(), token) : 0;
+    call.fParseJSON = false;
+    call.fIndex = 0;
+    call.fResponseLimit = responseLimit;
+    call.fResponseCount = 0;
+    return token;
+}
 
-        ConvertFromJS<std::string> appId(args[0]);
-        if (appId.value().empty()) {
-            throw std::runtime_error("Empty application Id is not allowed.");
+// One-reply call settled through a promise rather than a Call object
+Local<Value> LS2Handle::CallAsync(const char* busName, const char* payload, Local<Object> options)
+{
+    RequireHandle();
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+
+    unsigned timeout;
+    bool parseJSON;
+    ReadCallOptions(options, &timeout, &parseJSON);
+
+    Local<Promise::Resolver> resolver = Promise::Resolver::New(context).ToLocalChecked();
+
+    // Hold the call until the service is up, rather than have it fail
+    if (busName && !options.IsEmpty() && options->Get(context,
+            String::NewFromUtf8(isolate, "waitForService").ToLocalChecked()).ToLocalChecked()->BooleanValue(isolate)) {
+        std::string serviceName = ServiceOfURI(busName);
+        ServiceWatch& watch = WatchService(serviceName);
+        if (watch.fState != ServiceWatch::kUp) {
+            ServiceWaiter& waiter = AddServiceWaiter(watch, serviceName, resolver, timeout);
+            waiter.fIsCall = true;
+            waiter.fBusName = busName;
+            waiter.fPayload = payload ? payload : "";
+            waiter.fParseJSON = parseJSON;
+            return resolver->GetPromise();
         }
+    }
 
-        ConvertFromJS<std::string> servicePath(args[1]);
-        if (servicePath.value().empty()) {
-            throw std::runtime_error("Empty service path is not allowed.");
+    StartCallAsync(busName, payload, timeout, parseJSON, resolver);
+    return resolver->GetPromise();
+}
+
+void LS2Handle::StartCallAsync(const char* busName, const char* payload, unsigned timeout, bool parseJSON,
+                               Local<Promise::Resolver> resolver)
+{
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+
+    std::string cacheKey;
+    if (busName && payload && fCallCacheTTLs.count(busName)) {
+        cacheKey = CallCacheKey(busName, payload);
+
+        auto cached = fCallCache.find(cacheKey);
+        if (cached != fCallCache.end()) {
+            if (cached->second.fExpires > uv_hrtime()) {
+                fCacheHits++;
+                Local<String> cachedPayload = String::NewFromUtf8(isolate, cached->second.fPayload.c_str(),
+                    NewStringType::kNormal, cached->second.fPayload.size()).ToLocalChecked();
+                Local<Value> result;
+                TryCatch tryCatch(isolate);
+                if (!parseJSON) {
+                    resolver->Resolve(context, cachedPayload).Check();
+                } else if (JSON::Parse(context, cachedPayload).ToLocal(&result)) {
+                    resolver->Resolve(context, result).Check();
+                } else {
+                    resolver->Reject(context, tryCatch.Exception()).Check();
+                }
+                return;
+            }
+            fCallCache.erase(cached);
         }
 
-        auto serviceInfo = fRegisteredServices.find(servicePath.value());
-        if (serviceInfo != fRegisteredServices.end()) {
-            // generate exception only if servicePath is different
-            if (serviceInfo->second != appId.value()) {
-                throw std::runtime_error("Application Id already has been set.");
+        // Single flight: wait for the identical call already on the bus
+        auto inFlight = fCallsInFlight.find(cacheKey);
+        if (inFlight != fCallsInFlight.end()) {
+            fCacheCoalesced++;
+            PendingCall& call = fPendingCalls[inFlight->second];
+            call.fWaiters.emplace_back();
+            CallWaiter& waiter = call.fWaiters.back();
+            waiter.fId = fNextWaiterId++;
+            waiter.fResolver.Reset(isolate, resolver);
+            waiter.fParseJSON = parseJSON;
+            waiter.fTimer = 0;
+            // The waiter keeps its own deadline, the call it joined may have
+            // a later one or none
+            if (timeout) {
+                waiter.fTimer = LS2TimerWheel::Current()->Add(timeout, Serial(), waiter.fId | kCallWaiterCookie);
+                fCallWaiterTokens[waiter.fId] = inFlight->second;
             }
             return;
         }
+        fCacheMisses++;
+    }
 
-        fRegisteredServices[servicePath.value()] = appId.value();
+    LSMessageToken token = CallForPromise(busName, payload, 1, timeout);
+    PendingCall& call = fPendingCalls[token];
+    call.fResolver.Reset(isolate, resolver);
+    call.fParseJSON = parseJSON;
+    if (!cacheKey.empty()) {
+        call.fCacheKey = cacheKey;
+        fCallsInFlight[cacheKey] = token;
     }
-    catch(const std::exception& e) {
-        std::stringstream err_message;
-        err_message << "SetAppId: " << e.what();
-        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(
-            isolate, err_message.str().c_str()).ToLocalChecked()));
+}
+
+void LS2Handle::WaitForServiceWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    try {
+        if (args.Length() != 1 && args.Length() != 2) {
+            throw std::runtime_error("Invalid number of parameters");
+        }
+        LS2Handle* h = node::ObjectWrap::Unwrap<LS2Handle>(args.This());
+        if (!h) {
+            throw std::runtime_error("Unable to unwrap native object.");
+        }
+        ConvertFromJS<const char*> serviceName(args[0]);
+        int timeout = 0;
+        if (args.Length() == 2 && !args[1]->IsUndefined()) {
+            timeout = ConvertFromJS<int>(args[1]).value();
+        }
+        args.GetReturnValue().Set(h->WaitForService(serviceName.value(), timeout > 0 ? timeout : 0));
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
     }
-    catch(...) {
-        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(
-            isolate, "SetAppId: unknown exception").ToLocalChecked()));
+}
+
+// Resolves once the service is up, right away if it is known to be
+Local<Value> LS2Handle::WaitForService(const char* serviceName, unsigned timeout)
+{
+    RequireHandle();
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    Local<Promise::Resolver> resolver = Promise::Resolver::New(isolate->GetCurrentContext()).ToLocalChecked();
+    ServiceWatch& watch = WatchService(serviceName);
+    if (watch.fState == ServiceWatch::kUp) {
+        resolver->Resolve(isolate->GetCurrentContext(), v8::Undefined(isolate)).Check();
+    } else {
+        AddServiceWaiter(watch, serviceName, resolver, timeout).fIsCall = false;
     }
+    return resolver->GetPromise();
 }
 
-void LS2Handle::RequireHandle()
+void LS2Handle::OnServiceStatusWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
-    if (fHandle == 0) {
-        throw runtime_error("Handle object is missing native handle.");
+    v8::Isolate* isolate = args.GetIsolate();
+    try {
+        if (args.Length() != 2) {
+            throw std::runtime_error("Invalid number of parameters");
+        }
+        if (!args[1]->IsFunction()) {
+            throw std::runtime_error("Service status listener must be a function");
+        }
+        LS2Handle* h = node::ObjectWrap::Unwrap<LS2Handle>(args.This());
+        if (!h) {
+            throw std::runtime_error("Unable to unwrap native object.");
+        }
+        ConvertFromJS<const char*> serviceName(args[0]);
+        h->OnServiceStatus(serviceName.value(), Local<Function>::Cast(args[1]));
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
     }
 }
 
-void LS2Handle::checkCallerScriptPermissions(v8::Isolate* isolate)
+// Calls callback(connected, serviceName) on every change of the service's
+// status, starting with the current status when that is known. Never calls it
+// before returning, whether the status is known or not.
+void LS2Handle::OnServiceStatus(const char* serviceName, Local<Function> callback)
 {
-    Local<StackTrace> trace = StackTrace::CurrentStackTrace(isolate, 1, StackTrace::kScriptName);
-    ConvertFromJS<std::string> scriptName(trace->GetFrame(isolate, 0)->GetScriptName());
-    if (!trustedScripts.count(scriptName.value())) {
-        throw std::runtime_error("Incorrect execution context");
+    RequireHandle();
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    ServiceWatch& watch = WatchService(serviceName);
+    watch.fListeners.emplace_back(isolate, callback);
+    if (watch.fState != ServiceWatch::kUnknown) {
+        fInitialStatus.emplace_back(std::string(serviceName), Global<Function>(isolate, callback));
+        DeliverLater(kServiceStatusMessage, NULL);
     }
 }
 
-const std::string& LS2Handle::findMyAppId(v8::Isolate* isolate)
+void LS2Handle::OffServiceStatusWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
-    v8::Local<v8::StackTrace> trace = v8::StackTrace::CurrentStackTrace(isolate, 50, v8::StackTrace::kScriptName);
-    for(int i = 0; i < trace->GetFrameCount(); i++) {
-        std::string scriptName = ConvertFromJS<std::string>(trace->GetFrame(isolate, i)->GetScriptName()).value();
-        std::string scriptDirectory = scriptName.substr(0, scriptName.rfind('/'));
-        auto serviceInfo = fRegisteredServices.begin();
-        while(serviceInfo != fRegisteredServices.end()) {
-            if( scriptDirectory.find(serviceInfo->first) != std::string::npos) {
-                return serviceInfo->second;
-            }
-            serviceInfo++;
+    v8::Isolate* isolate = args.GetIsolate();
+    try {
+        if (args.Length() != 1 && args.Length() != 2) {
+            throw std::runtime_error("Invalid number of parameters");
+        }
+        LS2Handle* h = node::ObjectWrap::Unwrap<LS2Handle>(args.This());
+        if (!h) {
+            throw std::runtime_error("Unable to unwrap native object.");
+        }
+        ConvertFromJS<const char*> serviceName(args[0]);
+        Local<Function> callback;
+        if (args.Length() == 2 && args[1]->IsFunction()) {
+            callback = Local<Function>::Cast(args[1]);
         }
+        h->OffServiceStatus(serviceName.value(), callback);
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
     }
-    throw std::runtime_error("The service is not registered");
 }
 
-LS2Handle::RegisteredMethod::RegisteredMethod(const char* name)
+// Removes the listener, or all listeners of the service when callback is empty.
+// The watch itself stays, to keep the status cached.
+void LS2Handle::OffServiceStatus(const char* serviceName, Local<Function> callback)
+{
+    auto it = fServiceWatches.find(serviceName);
+    if (it == fServiceWatches.end()) {
+        return;
+    }
+    std::vector<Global<Function> >& listeners = it->second.fListeners;
+    for (size_t i = 0; i < listeners.size(); ) {
+        if (callback.IsEmpty() || listeners[i] == callback) {
+            listeners.erase(listeners.begin() + i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+void LS2Handle::GetServiceStatusWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    MemberFunctionWrapper<LS2Handle, Local<Value>, const char*>(&LS2Handle::GetServiceStatus, args);
+}
+
+// The cached status: true or false, or undefined when not known yet
+Local<Value> LS2Handle::GetServiceStatus(const char* serviceName)
+{
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    auto it = fServiceWatches.find(serviceName);
+    if (it == fServiceWatches.end() || it->second.fState == ServiceWatch::kUnknown) {
+        return v8::Undefined(isolate);
+    }
+    return Boolean::New(isolate, it->second.fState == ServiceWatch::kUp);
+}
+
+std::string LS2Handle::ServiceOfURI(const char* busName)
 {
-    std::memset(&fMethods, 0, sizeof(fMethods));
-    copy(name, name + strlen(name), back_inserter(fName));
-    fName.push_back(0);
-    fMethods[0].name = &fName[0];
-    fMethods[0].function = &LS2Handle::RequestCallback;
+    const char* name = strstr(busName, "://");
+    name = name ? name + 3 : busName;
+    const char* end = strchr(name, '/');
+    return end ? std::string(name, end - name) : std::string(name);
 }
 
-LSMethod* LS2Handle::RegisteredMethod::GetMethods()
+LS2Handle::ServiceWatch& LS2Handle::WatchService(const std::string& serviceName)
 {
-    return fMethods;
+    auto it = fServiceWatches.find(serviceName);
+    if (it != fServiceWatches.end()) {
+        return it->second;
+    }
+    RequireHandle();
+    void* cookie = 0;
+    LSErrorWrapper err;
+    if (!LSRegisterServerStatusEx(fHandle, serviceName.c_str(), &LS2Handle::ServerStatusCallback,
+                                  static_cast<void*>(this), &cookie, err)) {
+        err.ThrowError();
+    }
+    if (fServiceWatches.empty()) {
+        Ref();
+    }
+    ServiceWatch& watch = fServiceWatches[serviceName];
+    watch.fCookie = cookie;
+    watch.fState = ServiceWatch::kUnknown;
+    return watch;
+}
+
+LS2Handle::ServiceWaiter& LS2Handle::AddServiceWaiter(ServiceWatch& watch, const std::string& serviceName,
+                                                      Local<Promise::Resolver> resolver, unsigned timeout)
+{
+    watch.fWaiters.emplace_back();
+    ServiceWaiter& waiter = watch.fWaiters.back();
+    waiter.fId = fNextWaiterId++;
+    waiter.fResolver.Reset(v8::Isolate::GetCurrent(), resolver);
+    waiter.fTimer = 0;
+    waiter.fExpires = 0;
+    if (timeout) {
+        waiter.fTimer = LS2TimerWheel::Current()->Add(timeout, Serial(), waiter.fId | kServiceWaiterCookie);
+        waiter.fExpires = uv_now(node::GetCurrentEventLoop(v8::Isolate::GetCurrent())) + timeout;
+    }
+    fServiceWaiterNames[waiter.fId] = serviceName;
+    return waiter;
+}
+
+// May be called on the bus thread
+bool LS2Handle::ServerStatusCallback(LSHandle*, const char *serviceName, bool connected, void *ctx)
+{
+    LS2Handle* h = static_cast<LS2Handle*>(ctx);
+    {
+        std::lock_guard<std::mutex> lock(h->fStatusMutex);
+        h->fStatusChanges.push_back(std::make_pair(std::string(serviceName), connected));
+    }
+    return h->Deliver(kServiceStatusMessage, NULL);
+}
+
+bool LS2Handle::ServiceStatusArrived()
+{
+    std::vector<std::pair<std::string, bool> > changes;
+    {
+        std::lock_guard<std::mutex> lock(fStatusMutex);
+        changes.swap(fStatusChanges);
+    }
+
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    HandleScope scope(isolate);
+    node::CallbackScope callbackScope(isolate, this->handle(), {0, 0});
+    Local<Context> context = isolate->GetCurrentContext();
+    uv_loop_t* loop = node::GetCurrentEventLoop(isolate);
+
+    // The known status, to the listeners added since, unless removed already
+    std::vector<std::pair<std::string, Global<Function> > > initial;
+    initial.swap(fInitialStatus);
+    for (size_t i = 0; i < initial.size(); ++i) {
+        auto it = fServiceWatches.find(initial[i].first);
+        if (it == fServiceWatches.end() || it->second.fState == ServiceWatch::kUnknown) {
+            continue;
+        }
+        Local<Function> listener = initial[i].second.Get(isolate);
+        std::vector<Global<Function> >& listeners = it->second.fListeners;
+        if (std::find(listeners.begin(), listeners.end(), listener) == listeners.end()) {
+            continue;
+        }
+        Local<Value> argv[2] = {
+            Boolean::New(isolate, it->second.fState == ServiceWatch::kUp),
+            String::NewFromUtf8(isolate, initial[i].first.c_str()).ToLocalChecked()
+        };
+        node::MakeCallback(isolate, this->handle(), listener, 2, argv, {0, 0});
+    }
+
+    for (size_t i = 0; i < changes.size(); ++i) {
+        const std::string& serviceName = changes[i].first;
+        bool connected = changes[i].second;
+        auto it = fServiceWatches.find(serviceName);
+        if (it == fServiceWatches.end()) {
+            continue;
+        }
+        it->second.fState = connected ? ServiceWatch::kUp : ServiceWatch::kDown;
+
+        // Listeners may add or remove listeners, or unregister the handle
+        std::vector<Local<Function> > listeners;
+        for (size_t j = 0; j < it->second.fListeners.size(); ++j) {
+            listeners.push_back(it->second.fListeners[j].Get(isolate));
+        }
+        for (size_t j = 0; j < listeners.size(); ++j) {
+            Local<Value> argv[2] = {
+                Boolean::New(isolate, connected),
+                String::NewFromUtf8(isolate, serviceName.c_str()).ToLocalChecked()
+            };
+            node::MakeCallback(isolate, this->handle(), listeners[j], 2, argv, {0, 0});
+        }
+
+        it = fServiceWatches.find(serviceName);
+        if (!connected || it == fServiceWatches.end()) {
+            continue;
+        }
+        std::vector<ServiceWaiter> waiters;
+        waiters.swap(it->second.fWaiters);
+        uint64_t now = uv_now(loop);
+        for (size_t j = 0; j < waiters.size(); ++j) {
+            ServiceWaiter& waiter = waiters[j];
+            fServiceWaiterNames.erase(waiter.fId);
+            if (waiter.fTimer) {
+                LS2TimerWheel::Current()->Cancel(waiter.fTimer);
+            }
+            Local<Promise::Resolver> resolver = waiter.fResolver.Get(isolate);
+            if (!waiter.fIsCall) {
+                resolver->Resolve(context, v8::Undefined(isolate)).Check();
+                continue;
+            }
+            // The call gets what is left of its timeout
+            unsigned timeout = 0;
+            if (waiter.fExpires) {
+                timeout = waiter.fExpires > now ? waiter.fExpires - now : 1;
+            }
+            try {
+                StartCallAsync(waiter.fBusName.c_str(), waiter.fPayload.c_str(), timeout,
+                               waiter.fParseJSON, resolver);
+            } catch( std::exception const & ex ) {
+                resolver->Reject(context, Exception::Error(
+                    String::NewFromUtf8(isolate, ex.what()).ToLocalChecked())).Check();
+            }
+        }
+    }
+    return true;
+}
+
+void LS2Handle::ServiceWaiterExpired(uint64_t id)
+{
+    auto name = fServiceWaiterNames.find(id);
+    if (name == fServiceWaiterNames.end()) {
+        return;
+    }
+    auto it = fServiceWatches.find(name->second);
+    fServiceWaiterNames.erase(name);
+    if (it == fServiceWatches.end()) {
+        return;
+    }
+    std::vector<ServiceWaiter>& waiters = it->second.fWaiters;
+    for (size_t i = 0; i < waiters.size(); ++i) {
+        if (waiters[i].fId == id) {
+            v8::Isolate* isolate = v8::Isolate::GetCurrent();
+            HandleScope scope(isolate);
+            node::CallbackScope callbackScope(isolate, this->handle(), {0, 0});
+            Local<Promise::Resolver> resolver = waiters[i].fResolver.Get(isolate);
+            waiters.erase(waiters.begin() + i);
+            resolver->Reject(isolate->GetCurrentContext(), TimeoutError(isolate)).Check();
+            return;
+        }
+    }
+}
+
+void LS2Handle::CancelServiceWatches(const char* reason)
+{
+    if (fServiceWatches.empty()) {
+        return;
+    }
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    {
+        HandleScope scope(isolate);
+        Local<Context> context = isolate->GetCurrentContext();
+        Local<Value> error = Exception::Error(String::NewFromUtf8(isolate, reason).ToLocalChecked());
+        std::unordered_map<std::string, ServiceWatch> watches;
+        watches.swap(fServiceWatches);
+        fServiceWaiterNames.clear();
+        for (auto it = watches.begin(); it != watches.end(); ++it) {
+            if (fHandle) {
+                LSCancelServerStatus(fHandle, it->second.fCookie, NULL);
+            }
+            std::vector<ServiceWaiter>& waiters = it->second.fWaiters;
+            for (size_t i = 0; i < waiters.size(); ++i) {
+                if (waiters[i].fTimer) {
+                    LS2TimerWheel::Current()->Cancel(waiters[i].fTimer);
+                }
+                waiters[i].fResolver.Get(isolate)->Reject(context, error).Check();
+            }
+        }
+    }
+    Unref();
+}
+
+void LS2Handle::SetCallCacheTTLWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    VoidMemberFunctionWrapper<LS2Handle, const char*, int>(&LS2Handle::SetCallCacheTTL, args);
+}
+
+// Caches the responses of callAsync() to busName for ttl ms, and sends identical
+// calls made while one is pending only once. 0 turns both off.
+void LS2Handle::SetCallCacheTTL(const char* busName, int ttl)
+{
+    if (!busName) {
+        throw runtime_error("URI is required");
+    }
+    if (ttl < 0) {
+        throw runtime_error("Cache TTL must not be negative");
+    }
+    InvalidateCallCache(busName);
+    if (ttl == 0) {
+        fCallCacheTTLs.erase(busName);
+    } else {
+        fCallCacheTTLs[busName] = uint64_t(ttl) * 1000000;
+    }
+}
+
+void LS2Handle::InvalidateCallCacheWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    if (args.Length() == 0) {
+        // invalidateCallCache() drops everything
+        v8::Isolate* isolate = args.GetIsolate();
+        LS2Handle* h = node::ObjectWrap::Unwrap<LS2Handle>(args.This());
+        if (!h) {
+            isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+                "Unable to unwrap native object.").ToLocalChecked()));
+            return;
+        }
+        h->InvalidateCallCache(NULL);
+        return;
+    }
+    VoidMemberFunctionWrapper<LS2Handle, const char*>(&LS2Handle::InvalidateCallCache, args);
+}
+
+// Drops the cached responses of busName, or all of them when busName is NULL.
+// Calls in flight still settle their callers but are not cached.
+void LS2Handle::InvalidateCallCache(const char* busName)
+{
+    if (!busName) {
+        fCallCache.clear();
+        fCallsInFlight.clear();
+    } else {
+        std::string prefix = std::string(busName) + '\n';
+        for (auto i = fCallCache.begin(); i != fCallCache.end(); ) {
+            i = i->first.compare(0, prefix.size(), prefix) == 0 ? fCallCache.erase(i) : ++i;
+        }
+        for (auto i = fCallsInFlight.begin(); i != fCallsInFlight.end(); ) {
+            i = i->first.compare(0, prefix.size(), prefix) == 0 ? fCallsInFlight.erase(i) : ++i;
+        }
+    }
+    for (auto i = fPendingCalls.begin(); i != fPendingCalls.end(); ++i) {
+        if (!i->second.fCacheKey.empty() && !fCallsInFlight.count(i->second.fCacheKey)) {
+            i->second.fCacheKey.clear();
+        }
+    }
+}
+
+void LS2Handle::GetCallCacheStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    MemberFunctionWrapper<LS2Handle, Local<Value> >(&LS2Handle::GetCallCacheStats, args);
+}
+
+Local<Value> LS2Handle::GetCallCacheStats()
+{
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> result = Object::New(isolate);
+    result->Set(context, String::NewFromUtf8(isolate, "hits").ToLocalChecked(),
+                Number::New(isolate, fCacheHits)).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "misses").ToLocalChecked(),
+                Number::New(isolate, fCacheMisses)).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "coalesced").ToLocalChecked(),
+                Number::New(isolate, fCacheCoalesced)).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "entries").ToLocalChecked(),
+                Number::New(isolate, fCallCache.size())).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "inFlight").ToLocalChecked(),
+                Number::New(isolate, fCallsInFlight.size())).Check();
+    return result;
+}
+
+// Appends value as JSON with the keys of every object in sorted order
+static bool AppendCanonicalJSON(Isolate* isolate, Local<Context> context, Local<Value> value, std::string& out)
+{
+    if (value->IsArray()) {
+        Local<Array> array = Local<Array>::Cast(value);
+        out += '[';
+        for (uint32_t i = 0; i < array->Length(); ++i) {
+            Local<Value> element;
+            if (i) {
+                out += ',';
+            }
+            if (!array->Get(context, i).ToLocal(&element) || !AppendCanonicalJSON(isolate, context, element, out)) {
+                return false;
+            }
+        }
+        out += ']';
+        return true;
+    }
+    if (value->IsObject()) {
+        Local<Object> object = Local<Object>::Cast(value);
+        Local<Array> names;
+        if (!object->GetOwnPropertyNames(context, static_cast<PropertyFilter>(ONLY_ENUMERABLE | SKIP_SYMBOLS),
+                                         KeyConversionMode::kConvertToString).ToLocal(&names)) {
+            return false;
+        }
+        std::vector<std::pair<std::string, Local<Value> > > fields;
+        for (uint32_t i = 0; i < names->Length(); ++i) {
+            Local<Value> name;
+            Local<String> quoted;
+            if (!names->Get(context, i).ToLocal(&name) || !JSON::Stringify(context, name).ToLocal(&quoted)) {
+                return false;
+            }
+            String::Utf8Value utf8(isolate, quoted);
+            fields.push_back(std::make_pair(std::string(*utf8, utf8.length()), name));
+        }
+        std::sort(fields.begin(), fields.end(),
+                  [](const std::pair<std::string, Local<Value> >& a, const std::pair<std::string, Local<Value> >& b) {
+                      return a.first < b.first;
+                  });
+        out += '{';
+        for (size_t i = 0; i < fields.size(); ++i) {
+            Local<Value> field;
+            if (i) {
+                out += ',';
+            }
+            out += fields[i].first;
+            out += ':';
+            if (!object->Get(context, fields[i].second).ToLocal(&field) || !AppendCanonicalJSON(isolate, context, field, out)) {
+                return false;
+            }
+        }
+        out += '}';
+        return true;
+    }
+    Local<String> json;
+    if (!JSON::Stringify(context, value).ToLocal(&json)) {
+        return false;
+    }
+    String::Utf8Value utf8(isolate, json);
+    out.append(*utf8, utf8.length());
+    return true;
+}
+
+std::string LS2Handle::CallCacheKey(const char* busName, const char* payload)
+{
+    std::string key(busName);
+    key += '\n';
+
+    // The canonical form of JSON payloads, so that neither whitespace nor the
+    // order of the keys tells two calls apart
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    HandleScope scope(isolate);
+    Local<Context> context = isolate->GetCurrentContext();
+    TryCatch tryCatch(isolate);
+    Local<String> payloadString;
+    Local<Value> value;
+    if (String::NewFromUtf8(isolate, payload).ToLocal(&payloadString) &&
+            JSON::Parse(context, payloadString).ToLocal(&value)) {
+        std::string canonical;
+        if (AppendCanonicalJSON(isolate, context, value, canonical)) {
+            return key + canonical;
+        }
+    }
+
+    // Not JSON: only the whitespace outside strings is left out
+    bool inString = false;
+    for (const char* p = payload; *p; ++p) {
+        char c = *p;
+        if (inString) {
+            key += c;
+            if (c == '\\' && p[1]) {
+                key += *++p;
+            } else if (c == '"') {
+                inString = false;
+            }
+        } else if (c == '"') {
+            inString = true;
+            key += c;
+        } else if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            key += c;
+        }
+    }
+    return key;
+}
+
+// callMany(calls, [options]). Not a MemberFunctionWrapper, as the options are
+// optional.
+void LS2Handle::CallManyWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    try {
+        if (args.Length() != 1 && args.Length() != 2) {
+            throw std::runtime_error("Invalid number of parameters");
+        }
+        LS2Handle* h = node::ObjectWrap::Unwrap<LS2Handle>(args.This());
+        if (!h) {
+            throw std::runtime_error("Unable to unwrap native object.");
+        }
+        if (!args[0]->IsArray()) {
+            throw std::runtime_error("Calls must be an array");
+        }
+        Local<Object> options;
+        if (args.Length() == 2 && !args[1]->IsUndefined()) {
+            if (!args[1]->IsObject()) {
+                throw std::runtime_error("Call options must be an object");
+            }
+            options = Local<Object>::Cast(args[1]);
+        }
+        args.GetReturnValue().Set(h->CallMany(Local<Array>::Cast(args[0]), options));
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
+    }
+}
+
+// Issues all the calls and returns a promise for the array of their results,
+// settled once all of them (mode "all") or the first options.count of them (mode
+// "first") have completed.
+Local<Value> LS2Handle::CallMany(Local<Array> calls, Local<Object> options)
+{
+    RequireHandle();
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+
+    unsigned timeout;
+    bool parseJSON;
+    ReadCallOptions(options, &timeout, &parseJSON);
+
+    uint32_t count = calls->Length();
+    size_t needed = count;
+    if (!options.IsEmpty()) {
+        Local<Value> mode = options->Get(context, String::NewFromUtf8(isolate, "mode").ToLocalChecked()).ToLocalChecked();
+        if (!mode->IsUndefined()) {
+            std::string modeName = ConvertFromJS<std::string>(mode).value();
+            if (modeName == "first") {
+                Local<Value> first = options->Get(context, String::NewFromUtf8(isolate, "count").ToLocalChecked()).ToLocalChecked();
+                needed = first->IsUndefined() ? 1 : first->Uint32Value(context).FromJust();
+                needed = std::min(std::max(needed, size_t(1)), size_t(count));
+            } else if (modeName != "all") {
+                throw runtime_error("Unknown callMany mode");
+            }
+        }
+    }
+
+    // Convert everything before making the first call, so that a bad entry
+    // doesn't leave calls behind
+    std::vector<std::string> busNames(count);
+    std::vector<std::string> payloads(count);
+    std::vector<int> limits(count);
+    Local<String> uriName = String::NewFromUtf8(isolate, "uri").ToLocalChecked();
+    Local<String> payloadName = String::NewFromUtf8(isolate, "payload").ToLocalChecked();
+    Local<String> limitName = String::NewFromUtf8(isolate, "limit").ToLocalChecked();
+    for (uint32_t i = 0; i < count; ++i) {
+        Local<Value> entry = calls->Get(context, i).ToLocalChecked();
+        if (!entry->IsObject()) {
+            throw runtime_error("Each call must be an object");
+        }
+        Local<Object> call = Local<Object>::Cast(entry);
+        busNames[i] = ConvertFromJS<std::string>(call->Get(context, uriName).ToLocalChecked()).value();
+        payloads[i] = ConvertFromJS<std::string>(call->Get(context, payloadName).ToLocalChecked()).value();
+        Local<Value> limit = call->Get(context, limitName).ToLocalChecked();
+        limits[i] = limit->IsUndefined() ? 1 : limit->Int32Value(context).FromJust();
+        if (limits[i] < 1) {
+            throw runtime_error("Call limit must be at least 1");
+        }
+    }
+
+    Local<Promise::Resolver> resolver = Promise::Resolver::New(context).ToLocalChecked();
+    Local<Array> results = Array::New(isolate, count);
+    if (count == 0) {
+        resolver->Resolve(context, results).Check();
+        return resolver->GetPromise();
+    }
+
+    std::shared_ptr<CallGroup> group = std::make_shared<CallGroup>();
+    group->fResolver.Reset(isolate, resolver);
+    group->fResults.Reset(isolate, results);
+    group->fNeeded = needed;
+    group->fCompleted = 0;
+    group->fSettled = false;
+    group->fTokens.reserve(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        LSMessageToken token;
+        try {
+            token = CallForPromise(busNames[i].c_str(), payloads[i].c_str(), limits[i], timeout);
+        } catch (...) {
+            // Take back the calls already made
+            for (size_t j = 0; j < group->fTokens.size(); ++j) {
+                LSCallCancel(fHandle, group->fTokens[j], NULL);
+                ForgetPendingCall(fPendingCalls.find(group->fTokens[j]));
+            }
+            if (fPendingCalls.empty() && !group->fTokens.empty()) {
+                Unref();
+            }
+            throw;
+        }
+        PendingCall& call = fPendingCalls[token];
+        call.fGroup = group;
+        call.fIndex = i;
+        call.fParseJSON = parseJSON;
+        group->fTokens.push_back(token);
+    }
+    return resolver->GetPromise();
+}
+
+Local<Value> LS2Handle::CallInternal(const char* busName, const char* payload, int responseLimit, const char* sessionId,
+                                     const LS2CallOptions* options)
+{
+    RequireHandle();
+    Local<Object> callObject = LS2Call::NewForCall();
+    LS2Call *call = node::ObjectWrap::Unwrap<LS2Call>(callObject);
+    if (!call) {
+        v8::Isolate* isolate = v8::Isolate::GetCurrent();
+        return isolate->ThrowException(
+                v8::String::NewFromUtf8(isolate, "Unable to unwrap native object.").ToLocalChecked());
+    }
+    call->SetHandle(this);
+    LS2CallOptions defaults;
+    if (!options) {
+        defaults.fRetry = fRetryPolicy;
+        options = &defaults;
+    }
+    if (sessionId != NULL)
+        call->Call(busName, payload, responseLimit, sessionId, options);
+    else
+        call->Call(busName, payload, responseLimit, NULL, options);
+    return callObject;
+}
+
+LSMessageToken LS2Handle::JoinSharedSubscription(const char* busName, const char* payload, uint64_t serial,
+                                                 LSMessage** last)
+{
+    RequireHandle();
+    std::string key = CallCacheKey(busName, payload);
+    std::unordered_map<std::string, LSMessageToken>::iterator existing = fSharedTokens.find(key);
+    if (existing != fSharedTokens.end()) {
+        SharedSubscription& subscription = fSharedSubscriptions[existing->second];
+        subscription.fSubscribers.push_back(serial);
+        *last = subscription.fLast;
+        return existing->second;
+    }
+
+    LSMessageToken token;
+    LSErrorWrapper err;
+    if (!LSCall(fHandle, busName, payload, &LS2Handle::SharedResponseCallback, this, &token, err)) {
+        err.ThrowError();
+    }
+    SharedSubscription& subscription = fSharedSubscriptions[token];
+    subscription.fKey = key;
+    subscription.fLast = 0;
+    subscription.fSubscribers.push_back(serial);
+    fSharedTokens[key] = token;
+    *last = 0;
+    return token;
+}
+
+void LS2Handle::LeaveSharedSubscription(LSMessageToken token, uint64_t serial)
+{
+    auto it = fSharedSubscriptions.find(token);
+    if (it == fSharedSubscriptions.end()) {
+        return;
+    }
+    std::vector<uint64_t>& subscribers = it->second.fSubscribers;
+    subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), serial), subscribers.end());
+    if (!subscribers.empty()) {
+        return;
+    }
+    if (fHandle) {
+        LSCallCancel(fHandle, token, NULL);
+    }
+    if (it->second.fLast) {
+        LSMessageUnref(it->second.fLast);
+    }
+    fSharedTokens.erase(it->second.fKey);
+    fSharedSubscriptions.erase(it);
+}
+
+bool LS2Handle::SharedResponseCallback(LSHandle*, LSMessage *message, void *ctx)
+{
+    LS2Handle* h = static_cast<LS2Handle*>(ctx);
+    return h->Deliver(kSharedResponseMessage, message);
+}
+
+bool LS2Handle::SharedResponseArrived(LSMessage *message)
+{
+    LSMessageToken token = LSMessageGetResponseToken(message);
+    auto it = fSharedSubscriptions.find(token);
+    if (it == fSharedSubscriptions.end()) {
+        return true;
+    }
+    std::vector<uint64_t> subscribers(it->second.fSubscribers);
+
+    const char* category = LSMessageGetCategory(message);
+    bool ended = (category && strcmp(LUNABUS_ERROR_CATEGORY, category) == 0);
+    if (ended) {
+        // The bus has ended the subscription; every subscriber gets the error
+        // and then cancels itself
+        if (it->second.fLast) {
+            LSMessageUnref(it->second.fLast);
+        }
+        fSharedTokens.erase(it->second.fKey);
+        fSharedSubscriptions.erase(it);
+    } else {
+        LSMessageRef(message);
+        if (it->second.fLast) {
+            LSMessageUnref(it->second.fLast);
+        }
+        it->second.fLast = message;
+    }
+
+    for (size_t i = 0; i < subscribers.size(); ++i) {
+        if (!ended) {
+            // Listeners may cancel other subscribers, or the whole subscription
+            it = fSharedSubscriptions.find(token);
+            if (it == fSharedSubscriptions.end()) {
+                break;
+            }
+            const std::vector<uint64_t>& current = it->second.fSubscribers;
+            if (std::find(current.begin(), current.end(), subscribers[i]) == current.end()) {
+                continue;
+            }
+        }
+        LS2Base* call = LS2Base::FromSerial(subscribers[i]);
+        if (call) {
+            call->MessageArrived(kResponseMessage, message);
+        }
+    }
+    return true;
+}
+
+void LS2Handle::ForgetSharedSubscriptions()
+{
+    for (auto it = fSharedSubscriptions.begin(); it != fSharedSubscriptions.end(); ++it) {
+        if (it->second.fLast) {
+            LSMessageUnref(it->second.fLast);
+        }
+    }
+    fSharedSubscriptions.clear();
+    fSharedTokens.clear();
+}
+
+void LS2Handle::Attach(GMainLoop *mainLoop)
+{
+    LSErrorWrapper err;
+    if(!LSGmainAttach(fHandle, mainLoop, err)) {
+        err.ThrowError();
+    }
+}
+
+bool LS2Handle::RegisterCategory(const char* categoryName, LSMethod *methods)
+{
+    LSErrorWrapper err;
+    const char* catName = CategoryName(categoryName);
+
+    if(!LSRegisterCategoryAppend(fHandle, catName, methods, 0, err)) {
+        err.ThrowError();
+    }
+
+    if(!LSCategorySetData(fHandle, catName, static_cast<void*>(this), err)) {
+        err.ThrowError();
+    }
+
+    return true;
+}
+
+bool LS2Handle::MessageArrived(MessageKind kind, LSMessage *message)
+{
+    if (kind == kCancelMessage) {
+        return CancelArrived(message);
+    }
+    if (kind == kAsyncResponseMessage) {
+        return AsyncResponseArrived(message);
+    }
+    if (kind == kSharedResponseMessage) {
+        return SharedResponseArrived(message);
+    }
+    if (kind == kServiceStatusMessage) {
+        return ServiceStatusArrived();
+    }
+    if (kind == kAdmissionMessage) {
+        return AdmissionArrived();
+    }
+    return RequestArrived(message);
+}
+
+bool LS2Handle::CancelCallback(LSHandle *sh, LSMessage *message, void *ctx)
+{
+    LS2Handle* h = static_cast<LS2Handle*>(ctx);
+    return h->Deliver(kCancelMessage, message);
+}
+
+bool LS2Handle::CancelArrived(LSMessage *message)
+{
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    HandleScope scope(isolate);
+    //UnrefIfPending(LSMessageGetResponseToken(message));
+    EmitMessage(Local<String>::New(isolate, cancel_symbol), message);
+    return true;
+}
+
+bool LS2Handle::RequestCallback(LSHandle *sh, LSMessage *message, void *ctx)
+{
+    LS2Handle* h = static_cast<LS2Handle*>(ctx);
+    return h->Deliver(kRequestMessage, message);
+}
+
+const char* LS2Handle::CategoryName(const char* category)
+{
+    return category && *category ? category : "/";
+}
+
+bool LS2Handle::AsyncResponseCallback(LSHandle *sh, LSMessage *message, void *ctx)
+{
+    LS2Handle* h = static_cast<LS2Handle*>(ctx);
+    return h->Deliver(kAsyncResponseMessage, message);
+}
+
+// The value a response settles its promise with. failed is set for bus errors
+// (including timeouts), with an Error carrying the bus error method and payload,
+// and for payloads that don't parse, with the exception.
+static Local<Value> ResponseValue(Isolate* isolate, LSMessage* message, bool parseJSON, bool* busError, bool* failed)
+{
+    Local<Context> context = isolate->GetCurrentContext();
+    const char* payload = LSMessageGetPayload(message);
+    Local<String> payloadString = String::NewFromUtf8(isolate, payload ? payload : "").ToLocalChecked();
+    const char* category = LSMessageGetCategory(message);
+    *busError = category && strcmp(LUNABUS_ERROR_CATEGORY, category) == 0;
+    *failed = *busError;
+    if (*busError) {
+        const char* method = LSMessageGetMethod(message);
+        Local<Object> error = Local<Object>::Cast(Exception::Error(payloadString));
+        error->Set(context, String::NewFromUtf8(isolate, "method").ToLocalChecked(),
+                   ConvertToJS<const char*>(method ? method : "")).Check();
+        error->Set(context, String::NewFromUtf8(isolate, "payload").ToLocalChecked(),
+                   payloadString).Check();
+        return error;
+    }
+    if (parseJSON) {
+        TryCatch tryCatch(isolate);
+        Local<Value> result;
+        if (JSON::Parse(context, payloadString).ToLocal(&result)) {
+            return result;
+        }
+        *failed = true;
+        return tryCatch.Exception();
+    }
+    return payloadString;
+}
+
+// Whether a response may be cached: a JSON payload that does not report
+// "returnValue": false
+static bool IsSuccessfulResponse(Isolate* isolate, const char* payload)
+{
+    Local<Context> context = isolate->GetCurrentContext();
+    TryCatch tryCatch(isolate);
+    Local<Value> result;
+    if (!payload || !JSON::Parse(context, String::NewFromUtf8(isolate, payload).ToLocalChecked()).ToLocal(&result)) {
+        return false;
+    }
+    if (!result->IsObject()) {
+        return true;
+    }
+    Local<Value> returnValue;
+    if (!Local<Object>::Cast(result)->Get(context,
+            String::NewFromUtf8(isolate, "returnValue").ToLocalChecked()).ToLocal(&returnValue)) {
+        return false;
+    }
+    return !returnValue->IsFalse();
+}
+
+bool LS2Handle::AsyncResponseArrived(LSMessage *message)
+{
+    PendingCallMap::iterator it = fPendingCalls.find(LSMessageGetResponseToken(message));
+    if (it != fPendingCalls.end()) {
+        SettlePendingCall(it, message);
+    }
+    return true;
+}
+
+// The deadline of a callAsync() or callMany() call passed
+void LS2Handle::TimerExpired(uint64_t cookie)
+{
+    if (cookie & kServiceWaiterCookie) {
+        return ServiceWaiterExpired(cookie & ~kServiceWaiterCookie);
+    }
+    if (cookie & kQueuedRequestCookie) {
+        return QueuedRequestExpired(cookie & ~kQueuedRequestCookie);
+    }
+    if (cookie & kCallWaiterCookie) {
+        return CallWaiterExpired(cookie & ~kCallWaiterCookie);
+    }
+    PendingCallMap::iterator it = fPendingCalls.find(cookie);
+    if (it == fPendingCalls.end()) {
+        return;
+    }
+    it->second.fTimer = 0;
+    if (fHandle) {
+        LSCallCancel(fHandle, it->first, NULL);
+    }
+    SettlePendingCall(it, NULL);
+}
+
+// The timeout of a callAsync() that joined an identical call passed: only its
+// own promise is rejected, the call goes on for the others
+void LS2Handle::CallWaiterExpired(uint64_t id)
+{
+    auto token = fCallWaiterTokens.find(id);
+    if (token == fCallWaiterTokens.end()) {
+        return;
+    }
+    PendingCallMap::iterator it = fPendingCalls.find(token->second);
+    fCallWaiterTokens.erase(token);
+    if (it == fPendingCalls.end()) {
+        return;
+    }
+    std::vector<CallWaiter>& waiters = it->second.fWaiters;
+    for (size_t i = 0; i < waiters.size(); ++i) {
+        if (waiters[i].fId == id) {
+            v8::Isolate* isolate = v8::Isolate::GetCurrent();
+            HandleScope scope(isolate);
+            node::CallbackScope callbackScope(isolate, this->handle(), {0, 0});
+            Local<Promise::Resolver> resolver = waiters[i].fResolver.Get(isolate);
+            waiters.erase(waiters.begin() + i);
+            resolver->Reject(isolate->GetCurrentContext(), TimeoutError(isolate)).Check();
+            return;
+        }
+    }
+}
+
+void LS2Handle::ForgetCallWaiters(std::vector<CallWaiter>& waiters)
+{
+    for (size_t i = 0; i < waiters.size(); ++i) {
+        if (waiters[i].fTimer) {
+            LS2TimerWheel::Current()->Cancel(waiters[i].fTimer);
+            fCallWaiterTokens.erase(waiters[i].fId);
+        }
+    }
+}
+
+void LS2Handle::ForgetPendingCall(PendingCallMap::iterator it)
+{
+    if (it->second.fTimer) {
+        LS2TimerWheel::Current()->Cancel(it->second.fTimer);
+    }
+    fPendingCalls.erase(it);
+}
+
+// The Error a call or wait that ran out of time is rejected with
+Local<Value> LS2Handle::TimeoutError(v8::Isolate* isolate)
+{
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> error = Local<Object>::Cast(Exception::Error(
+        String::NewFromUtf8(isolate, "Call timed out").ToLocalChecked()));
+    error->Set(context, String::NewFromUtf8(isolate, "method").ToLocalChecked(),
+               String::NewFromUtf8(isolate, "timeout").ToLocalChecked()).Check();
+    return error;
+}
+
+// Settles the promise of a callAsync(), or records the response of a call of a
+// callMany() and settles its promise once enough calls have completed. message
+// is NULL when the call timed out.
+void LS2Handle::SettlePendingCall(PendingCallMap::iterator it, LSMessage *message)
+{
+    LSMessageToken token = it->first;
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    {
+        HandleScope scope(isolate);
+
+        // Runs the microtasks, i.e. the promise reactions, when it goes away
+        node::CallbackScope callbackScope(isolate, this->handle(), {0, 0});
+        Local<Context> context = isolate->GetCurrentContext();
+
+        PendingCall& call = it->second;
+        bool busError = false;
+        bool failed = true;
+        Local<Value> value;
+        if (message) {
+            value = ResponseValue(isolate, message, call.fParseJSON, &busError, &failed);
+        } else {
+            value = TimeoutError(isolate);
+        }
+
+        if (!call.fGroup) {
+            Local<Promise::Resolver> resolver = call.fResolver.Get(isolate);
+            std::vector<CallWaiter> waiters;
+            waiters.swap(call.fWaiters);
+            ForgetCallWaiters(waiters);
+            if (!call.fCacheKey.empty()) {
+                fCallsInFlight.erase(call.fCacheKey);
+                auto ttl = fCallCacheTTLs.find(call.fCacheKey.substr(0, call.fCacheKey.find('\n')));
+                if (message && !busError && ttl != fCallCacheTTLs.end() &&
+                        IsSuccessfulResponse(isolate, LSMessageGetPayload(message))) {
+                    uint64_t now = uv_hrtime();
+                    if (fCallCache.size() >= kMaxCachedResponses) {
+                        for (auto i = fCallCache.begin(); i != fCallCache.end(); ) {
+                            i = i->second.fExpires <= now ? fCallCache.erase(i) : ++i;
+                        }
+                    }
+                    const char* payload = LSMessageGetPayload(message);
+                    CachedResponse& cached = fCallCache[call.fCacheKey];
+                    cached.fPayload = payload ? payload : "";
+                    cached.fExpires = now + ttl->second;
+                }
+            }
+            ForgetPendingCall(it);
+            if (failed) {
+                resolver->Reject(context, value).Check();
+            } else {
+                resolver->Resolve(context, value).Check();
+            }
+            for (size_t i = 0; i < waiters.size(); ++i) {
+                Local<Value> waiterValue = value;
+                if (message) {
+                    waiterValue = ResponseValue(isolate, message, waiters[i].fParseJSON, &busError, &failed);
+                }
+                if (failed) {
+                    waiters[i].fResolver.Get(isolate)->Reject(context, waiterValue).Check();
+                } else {
+                    waiters[i].fResolver.Get(isolate)->Resolve(context, waiterValue).Check();
+                }
+            }
+        } else {
+            std::shared_ptr<CallGroup> group = call.fGroup;
+            Local<Array> results = group->fResults.Get(isolate);
+            call.fResponseCount++;
+            if (call.fResponseLimit == 1) {
+                results->Set(context, call.fIndex, value).Check();
+            } else {
+                Local<Value> responses = results->Get(context, call.fIndex).ToLocalChecked();
+                if (!responses->IsArray()) {
+                    responses = Array::New(isolate);
+                    results->Set(context, call.fIndex, responses).Check();
+                }
+                Local<Array> list = Local<Array>::Cast(responses);
+                list->Set(context, list->Length(), value).Check();
+            }
+
+            if (failed || call.fResponseCount >= call.fResponseLimit) {
+                // The bus ends calls that failed or got their one reply by itself,
+                // and timed out calls are already canceled
+                if (message && !busError && call.fResponseLimit != 1) {
+                    LSCallCancel(fHandle, token, NULL);
+                }
+                ForgetPendingCall(it);
+                group->fCompleted++;
+                if (group->fCompleted == group->fNeeded && !group->fSettled) {
+                    group->fSettled = true;
+                    // Drop the calls that are no longer needed
+                    for (size_t i = 0; i < group->fTokens.size(); ++i) {
+                        PendingCallMap::iterator other = fPendingCalls.find(group->fTokens[i]);
+                        if (other != fPendingCalls.end()) {
+                            ForgetPendingCall(other);
+                            LSCallCancel(fHandle, group->fTokens[i], NULL);
+                        }
+                    }
+                    group->fResolver.Get(isolate)->Resolve(context, results).Check();
+                }
+            }
+        }
+    }
+
+    if (fPendingCalls.empty()) {
+        Unref();
+    }
+}
+
+void LS2Handle::RejectPendingCalls(const char* reason)
+{
+    if (fPendingCalls.empty()) {
+        return;
+    }
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    {
+        HandleScope scope(isolate);
+        Local<Context> context = isolate->GetCurrentContext();
+        Local<Value> error = Exception::Error(String::NewFromUtf8(isolate, reason).ToLocalChecked());
+        PendingCallMap calls;
+        calls.swap(fPendingCalls);
+        fCallsInFlight.clear();
+        for (PendingCallMap::iterator i = calls.begin(); i != calls.end(); ++i) {
+            PendingCall& call = i->second;
+            if (call.fTimer) {
+                LS2TimerWheel::Current()->Cancel(call.fTimer);
+            }
+            ForgetCallWaiters(call.fWaiters);
+            if (!call.fGroup) {
+                call.fResolver.Get(isolate)->Reject(context, error).Check();
+                for (size_t j = 0; j < call.fWaiters.size(); ++j) {
+                    call.fWaiters[j].fResolver.Get(isolate)->Reject(context, error).Check();
+                }
+            } else if (!call.fGroup->fSettled) {
+                call.fGroup->fSettled = true;
+                call.fGroup->fResolver.Get(isolate)->Reject(context, error).Check();
+            }
+        }
+    }
+    Unref();
+}
+
+std::string LS2Handle::MethodKey(const char* category, const char* methodName)
+{
+    std::string key(CategoryName(category));
+    key += ' ';
+    key += methodName ? methodName : "";
+    return key;
+}
+
+bool LS2Handle::RequestArrived(LSMessage *message)
+{
+    if (!fAdmissionLimits.empty()) {
+        std::string key = MethodKey(LSMessageGetCategory(message), LSMessageGetMethod(message));
+        auto it = fAdmissionLimits.find(key);
+        if (it == fAdmissionLimits.end()) {
+            key.clear();
+            it = fAdmissionLimits.find(key);
+        }
+        if (it != fAdmissionLimits.end()) {
+            AdmissionLimit& limit = it->second;
+            if (limit.fActive >= limit.fMaxConcurrent) {
+                if (limit.fQueue.size() < limit.fMaxQueued) {
+                    QueuedRequest request;
+                    request.fId = fNextRequestId++;
+                    request.fMessage = message;
+                    request.fTimer = limit.fMaxWait ? LS2TimerWheel::Current()->Add(
+                        limit.fMaxWait, Serial(), request.fId | kQueuedRequestCookie) : 0;
+                    LSMessageRef(message);
+                    limit.fQueue.push_back(request);
+                    fQueuedRequestKeys[request.fId] = key;
+                } else {
+                    // Shed the load without involving JS at all
+                    limit.fRejected++;
+                    RespondBusy(message, limit);
+                }
+                return true;
+            }
+            Admit(message, key, limit);
+        }
+    }
+    DispatchRequest(message);
+    return true;
+}
+
+void LS2Handle::DispatchRequest(LSMessage *message)
+{
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    // Methods registered with a handler skip the 'request' event
+    if (!fMethodHandlers.empty()) {
+        HandlerMap::const_iterator it = fMethodHandlers.find(
+            MethodKey(LSMessageGetCategory(message), LSMessageGetMethod(message)));
+        if (it != fMethodHandlers.end()) {
+            Local<Value> messageObject = LS2Message::NewFromMessage(message);
+            if (messageObject.IsEmpty()) {
+                // We don't want to silently lose messages
+                syslog(LOG_USER | LOG_CRIT, "%s: messageObject is empty", __PRETTY_FUNCTION__);
+                abort();
+            }
+            Local<Value> argv[1] = { messageObject };
+            node::MakeCallback(isolate, this->handle(), it->second.Get(isolate), 1, argv, {0, 0});
+            return;
+        }
+    }
+
+    EmitOrBatchMessage(Local<String>::New(isolate, request_symbol),
+                       Local<String>::New(isolate, requests_symbol), message);
+}
+
+void LS2Handle::Admit(LSMessage *message, const std::string& key, AdmissionLimit& limit)
+{
+    limit.fActive++;
+    limit.fAdmitted++;
+    AdmissionTicket& ticket = tAdmittedRequests[message];
+    ticket.fHandle = Serial();
+    ticket.fKey = key;
+    ticket.fEpoch = limit.fEpoch;
+}
+
+// Frees the slot of an answered or collected request. This may run while the
+// message is garbage collected, or inside respond(), so the queued requests are
+// admitted on a later loop turn rather than here.
+void LS2Handle::ReleaseAdmission(LSMessage *message)
+{
+    auto it = tAdmittedRequests.find(message);
+    if (it == tAdmittedRequests.end()) {
+        return;
+    }
+    LS2Handle* h = static_cast<LS2Handle*>(LS2Base::FromSerial(it->second.fHandle));
+    AdmissionTicket ticket;
+    ticket.fKey.swap(it->second.fKey);
+    ticket.fEpoch = it->second.fEpoch;
+    tAdmittedRequests.erase(it);
+    if (h) {
+        auto limit = h->fAdmissionLimits.find(ticket.fKey);
+        // A limit set again after being removed starts counting afresh
+        if (limit != h->fAdmissionLimits.end() && limit->second.fEpoch == ticket.fEpoch) {
+            limit->second.fActive--;
+            if (!limit->second.fQueue.empty()) {
+                h->ScheduleAdmission(ticket.fKey);
+            }
+        }
+    }
+}
+
+void LS2Handle::ScheduleAdmission(const std::string& key)
+{
+    if (fAdmissionsPending.empty()) {
+        DeliverLater(kAdmissionMessage, NULL);
+    }
+    fAdmissionsPending.insert(key);
+}
+
+bool LS2Handle::AdmissionArrived()
+{
+    std::set<std::string> keys;
+    keys.swap(fAdmissionsPending);
+    for (auto it = keys.begin(); it != keys.end(); ++it) {
+        AdmitQueuedRequests(*it);
+    }
+    return true;
+}
+
+// Dispatches queued requests for as long as the limit allows
+void LS2Handle::AdmitQueuedRequests(const std::string& key)
+{
+    for (;;) {
+        // Looked up again each time, as the listeners may change the limits
+        auto it = fAdmissionLimits.find(key);
+        if (it == fAdmissionLimits.end() || it->second.fQueue.empty()
+                || it->second.fActive >= it->second.fMaxConcurrent) {
+            return;
+        }
+        QueuedRequest request = it->second.fQueue.front();
+        it->second.fQueue.pop_front();
+        fQueuedRequestKeys.erase(request.fId);
+        if (request.fTimer) {
+            LS2TimerWheel::Current()->Cancel(request.fTimer);
+        }
+        Admit(request.fMessage, key, it->second);
+        DispatchRequest(request.fMessage);
+        LSMessageUnref(request.fMessage);
+    }
+}
+
+// A queued request waited longer than maxWait
+void LS2Handle::QueuedRequestExpired(uint64_t id)
+{
+    auto key = fQueuedRequestKeys.find(id);
+    if (key == fQueuedRequestKeys.end()) {
+        return;
+    }
+    auto it = fAdmissionLimits.find(key->second);
+    fQueuedRequestKeys.erase(key);
+    if (it == fAdmissionLimits.end()) {
+        return;
+    }
+    std::deque<QueuedRequest>& queue = it->second.fQueue;
+    for (auto request = queue.begin(); request != queue.end(); ++request) {
+        if (request->fId == id) {
+            it->second.fExpired++;
+            RespondBusy(request->fMessage, it->second);
+            LSMessageUnref(request->fMessage);
+            queue.erase(request);
+            return;
+        }
+    }
+}
+
+// Sends the busy response of limit to a request JS never sees
+void LS2Handle::RespondBusy(LSMessage *message, const AdmissionLimit& limit)
+{
+    LSErrorWrapper err;
+    if (!LSMessageRespond(message, limit.fBusyPayload.c_str(), err)) {
+        // Called from the bus or a timer, there is nobody to throw to
+        std::cerr << "Warning: LSMessageRespond failed for a busy response." << std::endl;
+        err.Print();
+    }
+}
+
+void LS2Handle::DropQueuedRequests()
+{
+    for (auto it = fAdmissionLimits.begin(); it != fAdmissionLimits.end(); ++it) {
+        std::deque<QueuedRequest>& queue = it->second.fQueue;
+        for (size_t i = 0; i < queue.size(); ++i) {
+            if (queue[i].fTimer) {
+                LS2TimerWheel::Current()->Cancel(queue[i].fTimer);
+            }
+            LSMessageUnref(queue[i].fMessage);
+        }
+        queue.clear();
+    }
+    fQueuedRequestKeys.clear();
+}
+
+void LS2Handle::SetAdmissionLimitWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    try {
+        if (args.Length() != 1 && args.Length() != 3) {
+            throw std::runtime_error("Invalid number of parameters");
+        }
+        LS2Handle* h = node::ObjectWrap::Unwrap<LS2Handle>(args.This());
+        if (!h) {
+            throw std::runtime_error("Unable to unwrap native object.");
+        }
+        if (args.Length() == 1) {
+            h->SetAdmissionLimit(std::string(), args[0]);
+        } else {
+            ConvertFromJS<const char*> category(args[0]);
+            ConvertFromJS<const char*> method(args[1]);
+            h->SetAdmissionLimit(MethodKey(category.value(), method.value()), args[2]);
+        }
+    } catch( std::exception const & ex ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            ex.what()).ToLocalChecked()));
+    } catch( ... ) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate,
+            "Native function threw an unknown exception.").ToLocalChecked()));
+    }
+}
+
+// Sets {maxConcurrent, maxQueued, maxWait, errorCode, errorText}, or removes the
+// limit for null. Changing a limit keeps the requests admitted or queued; removing
+// it hands the queued ones back to RequestArrived and forgets the admitted ones.
+void LS2Handle::SetAdmissionLimit(const std::string& key, Local<Value> options)
+{
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+    if (options->IsNull() || options->IsUndefined()) {
+        auto it = fAdmissionLimits.find(key);
+        if (it != fAdmissionLimits.end()) {
+            // Whatever is queued arrives again on a later loop turn, in order,
+            // and goes through the limits still set
+            std::deque<QueuedRequest> queue;
+            queue.swap(it->second.fQueue);
+            fAdmissionLimits.erase(it);
+            for (size_t i = 0; i < queue.size(); ++i) {
+                fQueuedRequestKeys.erase(queue[i].fId);
+                if (queue[i].fTimer) {
+                    LS2TimerWheel::Current()->Cancel(queue[i].fTimer);
+                }
+                DeliverLater(kRequestMessage, queue[i].fMessage);
+                LSMessageUnref(queue[i].fMessage);
+            }
+        }
+        return;
+    }
+    if (!options->IsObject()) {
+        throw std::runtime_error("Admission limit must be an object");
+    }
+    Local<Object> object = Local<Object>::Cast(options);
+    Local<Value> value = object->Get(context, String::NewFromUtf8(isolate, "maxConcurrent").ToLocalChecked()).ToLocalChecked();
+    double maxConcurrent = value->NumberValue(context).FromJust();
+    if (!(maxConcurrent >= 1)) {
+        throw std::runtime_error("maxConcurrent must be at least 1");
+    }
+    value = object->Get(context, String::NewFromUtf8(isolate, "maxQueued").ToLocalChecked()).ToLocalChecked();
+    double maxQueued = value->IsUndefined() ? 0 : value->NumberValue(context).FromJust();
+    if (!(maxQueued >= 0)) {
+        throw std::runtime_error("maxQueued must not be negative");
+    }
+    value = object->Get(context, String::NewFromUtf8(isolate, "maxWait").ToLocalChecked()).ToLocalChecked();
+    double maxWait = value->IsUndefined() ? 0 : value->NumberValue(context).FromJust();
+    if (!(maxWait >= 0)) {
+        throw std::runtime_error("maxWait must not be negative");
+    }
+    value = object->Get(context, String::NewFromUtf8(isolate, "errorCode").ToLocalChecked()).ToLocalChecked();
+    int errorCode = value->IsUndefined() ? -1 : value->Int32Value(context).FromJust();
+    value = object->Get(context, String::NewFromUtf8(isolate, "errorText").ToLocalChecked()).ToLocalChecked();
+    if (value->IsUndefined()) {
+        value = String::NewFromUtf8(isolate, "Service is busy").ToLocalChecked();
+    }
+
+    // The busy response is built once, here, so that shedding costs nothing
+    Local<Object> response = Object::New(isolate);
+    response->Set(context, String::NewFromUtf8(isolate, "returnValue").ToLocalChecked(),
+                  Boolean::New(isolate, false)).Check();
+    response->Set(context, String::NewFromUtf8(isolate, "errorCode").ToLocalChecked(),
+                  Integer::New(isolate, errorCode)).Check();
+    response->Set(context, String::NewFromUtf8(isolate, "errorText").ToLocalChecked(),
+                  value->ToString(context).ToLocalChecked()).Check();
+    String::Utf8Value busyPayload(isolate, JSON::Stringify(context, response).ToLocalChecked());
+
+    bool existed = fAdmissionLimits.count(key) != 0;
+    AdmissionLimit& limit = fAdmissionLimits[key];
+    if (!existed) {
+        limit.fActive = 0;
+        limit.fEpoch = fNextAdmissionEpoch++;
+        limit.fAdmitted = 0;
+        limit.fRejected = 0;
+        limit.fExpired = 0;
+    }
+    limit.fMaxConcurrent = int(std::min(maxConcurrent, double(std::numeric_limits<int>::max())));
+    limit.fMaxQueued = size_t(std::min(maxQueued, double(std::numeric_limits<uint32_t>::max())));
+    limit.fMaxWait = unsigned(std::min(maxWait, double(std::numeric_limits<uint32_t>::max())));
+    limit.fBusyPayload = *busyPayload;
+    if (!limit.fQueue.empty()) {
+        ScheduleAdmission(key);
+    }
+}
+
+void LS2Handle::GetAdmissionStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    MemberFunctionWrapper<LS2Handle, Local<Value> >(&LS2Handle::GetAdmissionStats, args);
+}
+
+// One entry per limit, keyed "category method", or "*" for the whole handle
+Local<Value> LS2Handle::GetAdmissionStats()
+{
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> result = Object::New(isolate);
+    for (auto it = fAdmissionLimits.begin(); it != fAdmissionLimits.end(); ++it) {
+        const AdmissionLimit& limit = it->second;
+        Local<Object> stats = Object::New(isolate);
+        stats->Set(context, String::NewFromUtf8(isolate, "active").ToLocalChecked(),
+                   Number::New(isolate, limit.fActive)).Check();
+        stats->Set(context, String::NewFromUtf8(isolate, "queued").ToLocalChecked(),
+                   Number::New(isolate, limit.fQueue.size())).Check();
+        stats->Set(context, String::NewFromUtf8(isolate, "admitted").ToLocalChecked(),
+                   Number::New(isolate, limit.fAdmitted)).Check();
+        stats->Set(context, String::NewFromUtf8(isolate, "rejected").ToLocalChecked(),
+                   Number::New(isolate, limit.fRejected)).Check();
+        stats->Set(context, String::NewFromUtf8(isolate, "expired").ToLocalChecked(),
+                   Number::New(isolate, limit.fExpired)).Check();
+        const char* name = it->first.empty() ? "*" : it->first.c_str();
+        result->Set(context, String::NewFromUtf8(isolate, name).ToLocalChecked(), stats).Check();
+    }
+    return result;
+}
+
+void LS2Handle::SetAppId(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    try {
+        if (args.Length() < 2) {
+            throw std::runtime_error("Invalid arguments");
+        }
+
+        ConvertFromJS<const char*> serviceName(args[0]);
+        if (serviceName.value()) {
+            if (strcmp(serviceName.value(), "com.webos.service.jsserver"))
+                checkCallerScriptPermissions(isolate);
+        }
+
+        ConvertFromJS<std::string> appId(args[0]);
+        if (appId.value().empty()) {
+            throw std::runtime_error("Empty application Id is not allowed.");
+        }
+
+        ConvertFromJS<std::string> servicePath(args[1]);
+        if (servicePath.value().empty()) {
+            throw std::runtime_error("Empty service path is not allowed.");
+        }
+
+        std::lock_guard<std::mutex> lock(fRegisteredServicesMutex);
+        auto serviceInfo = fRegisteredServices.find(servicePath.value());
+        if (serviceInfo != fRegisteredServices.end()) {
+            // generate exception only if servicePath is different
+            if (serviceInfo->second != appId.value()) {
+                throw std::runtime_error("Application Id already has been set.");
+            }
+            return;
+        }
+
+        fRegisteredServices[servicePath.value()] = appId.value();
+        fScriptAppIds.clear();
+    }
+    catch(const std::exception& e) {
+        std::stringstream err_message;
+        err_message << "SetAppId: " << e.what();
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(
+            isolate, err_message.str().c_str()).ToLocalChecked()));
+    }
+    catch(...) {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(
+            isolate, "SetAppId: unknown exception").ToLocalChecked()));
+    }
+}
+
+void LS2Handle::RequireHandle()
+{
+    if (fHandle == 0) {
+        throw runtime_error("Handle object is missing native handle.");
+    }
+}
+
+void LS2Handle::checkCallerScriptPermissions(v8::Isolate* isolate)
+{
+    Local<StackTrace> trace = StackTrace::CurrentStackTrace(isolate, 1, StackTrace::kScriptName);
+    ConvertFromJS<std::string> scriptName(trace->GetFrame(isolate, 0)->GetScriptName());
+    if (!trustedScripts.count(scriptName.value())) {
+        throw std::runtime_error("Incorrect execution context");
+    }
+}
+
+std::string LS2Handle::findMyAppId(v8::Isolate* isolate)
+{
+    v8::Local<v8::StackTrace> trace = v8::StackTrace::CurrentStackTrace(isolate, 50, v8::StackTrace::kScriptName);
+    std::lock_guard<std::mutex> lock(fRegisteredServicesMutex);
+    for(int i = 0; i < trace->GetFrameCount(); i++) {
+        std::string scriptName = ConvertFromJS<std::string>(trace->GetFrame(isolate, i)->GetScriptName()).value();
+        const std::string& appId = resolveScriptAppId(scriptName);
+        if (!appId.empty()) {
+            return appId;
+        }
+    }
+    throw std::runtime_error("The service is not registered");
+}
+
+// Finds the application ID of the service whose path contains the directory of
+// scriptName. Called with fRegisteredServicesMutex held.
+const std::string& LS2Handle::resolveScriptAppId(const std::string& scriptName)
+{
+    // Bound the memo, script names of a process are few
+    static const size_t kMaxScriptAppIds = 1024;
+
+    auto cached = fScriptAppIds.find(scriptName);
+    if (cached != fScriptAppIds.end()) {
+        return cached->second;
+    }
+    if (fScriptAppIds.size() >= kMaxScriptAppIds) {
+        fScriptAppIds.clear();
+    }
+    std::string& appId = fScriptAppIds[scriptName];
+
+    std::string scriptDirectory = scriptName.substr(0, scriptName.rfind('/'));
+
+    // Service paths are normally the directory of the service or one of its
+    // ancestors, which takes one lookup per path component
+    std::string directory = scriptDirectory;
+    while (!directory.empty()) {
+        auto serviceInfo = fRegisteredServices.find(directory);
+        if (serviceInfo == fRegisteredServices.end()) {
+            serviceInfo = fRegisteredServices.find(directory + '/');
+        }
+        if (serviceInfo != fRegisteredServices.end()) {
+            appId = serviceInfo->second;
+            return appId;
+        }
+        size_t slash = directory.rfind('/');
+        if (slash == std::string::npos || slash == 0) {
+            break;
+        }
+        directory.resize(slash);
+    }
+
+    // Any other service path matches anywhere in the directory
+    for (auto serviceInfo = fRegisteredServices.begin(); serviceInfo != fRegisteredServices.end(); ++serviceInfo) {
+        if (scriptDirectory.find(serviceInfo->first) != std::string::npos) {
+            appId = serviceInfo->second;
+            break;
+        }
+    }
+    return appId;
+}
+
+LSMethod* LS2Handle::CategoryArena::AddTable(const std::vector<std::string>& methodNames)
+{
+    std::unique_ptr<LSMethod[]> table(new LSMethod[methodNames.size() + 1]);
+    std::memset(table.get(), 0, sizeof(LSMethod) * (methodNames.size() + 1));
+    for (size_t i = 0; i < methodNames.size(); ++i) {
+        fNames.push_back(methodNames[i]);
+        table[i].name = fNames.back().c_str();
+        table[i].function = &LS2Handle::RequestCallback;
+    }
+    fTables.push_back(std::move(table));
+    return fTables.back().get();
 }
@@ -19,7 +19,10 @@
 
 #include "node_ls2_base.h"
 
+#include <deque>
+#include <memory>
 #include <set>
+#include <mutex>
 #include <glib.h>
 #include <luna-service2/lunaservice.h>
 #include <vector>
@@ -28,6 +31,9 @@
 
 class LS2Message;
 class LS2Call;
+class LS2Publisher;
+class LS2RetryPolicy;
+struct LS2CallOptions;
 
 class LS2Handle : public LS2Base {
 public:
@@ -40,6 +46,31 @@ public:
     LSHandle* Get();
     bool IsValid() { return fHandle != 0;}
 
+    virtual bool MessageArrived(MessageKind kind, LSMessage *message);
+
+    // Adds the Call with the given serial number to the subscriber list of the
+    // upstream subscription for busName and payload, subscribing first if there
+    // is none. Sets last to the latest update received so far, if any. Returns
+    // the token of the upstream subscription.
+    LSMessageToken JoinSharedSubscription(const char* busName, const char* payload, uint64_t serial,
+                                          LSMessage** last);
+
+    // Removes a subscriber, canceling the upstream subscription with the last one.
+    void LeaveSharedSubscription(LSMessageToken token, uint64_t serial);
+
+    // Counts a failed attempt of a Call that is made again, or that had no
+    // attempts left
+    void CountRetry(bool exhausted);
+
+    // Frees the admission slot held by a request, if any. Called by LS2Message
+    // on the first respond() and when it lets go of the message.
+    static void RequestFinished(LSMessage *message)
+    {
+        if (!tAdmittedRequests.empty()) {
+            ReleaseAdmission(message);
+        }
+    }
+
 protected:
 	// Called by V8 when the "Handle" function is used with new.
 	static void New(const v8::FunctionCallbackInfo<v8::Value>& args);
@@ -68,20 +99,104 @@ private:
 	static void CancelWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
 	bool Cancel(LSMessageToken token);
 
+	static void CallAsyncWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	v8::Local<v8::Value> CallAsync(const char* busName, const char* payload, v8::Local<v8::Object> options);
+
+	// callAsync() from the cache, joined to an identical call, or on the bus
+	void StartCallAsync(const char* busName, const char* payload, unsigned timeout, bool parseJSON,
+	                    v8::Local<v8::Promise::Resolver> resolver);
+
+	static void WaitForServiceWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	static void OnServiceStatusWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	static void OffServiceStatusWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	static void GetServiceStatusWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	v8::Local<v8::Value> WaitForService(const char* serviceName, unsigned timeout);
+	void OnServiceStatus(const char* serviceName, v8::Local<v8::Function> callback);
+	void OffServiceStatus(const char* serviceName, v8::Local<v8::Function> callback);
+	v8::Local<v8::Value> GetServiceStatus(const char* serviceName);
+
+	// The service name part of a "luna://service/method" URI
+	static std::string ServiceOfURI(const char* busName);
+
+	static void CallManyWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	v8::Local<v8::Value> CallMany(v8::Local<v8::Array> calls, v8::Local<v8::Object> options);
+
+	static void SetCallCacheTTLWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	void SetCallCacheTTL(const char* busName, int ttl);
+
+	static void InvalidateCallCacheWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	void InvalidateCallCache(const char* busName);
+
+	static void GetCallCacheStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	v8::Local<v8::Value> GetCallCacheStats();
+
+	// Cache key of a call: the URI and the payload in canonical form, with
+	// the keys of its objects sorted and no insignificant whitespace
+	static std::string CallCacheKey(const char* busName, const char* payload);
+
+	// Reads the options common to callAsync and callMany
+	static unsigned ReadTimeout(v8::Local<v8::Object> options);
+	static void ReadCallOptions(v8::Local<v8::Object> options, unsigned* timeout, bool* parseJSON);
+
+	// Makes a call whose responses go to AsyncResponseCallback
+	LSMessageToken CallForPromise(const char* busName, const char* payload, int responseLimit, unsigned timeout);
+
 	static void RegisterMethodWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
-	void RegisterMethod(const char* category, const char* methodName);
+	void RegisterMethod(const char* category, const char* methodName,
+	                    v8::Local<v8::Function> handler = v8::Local<v8::Function>());
+
+	static void RegisterMethodsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	void RegisterMethods(const char* category, const std::vector<std::string>& methodNames,
+	                     const std::vector<v8::Local<v8::Function> >& handlers);
 
 	static void UnregisterWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
 	void Unregister();
 
+	static void SetRetryPolicyWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	void SetRetryPolicy(v8::Local<v8::Value> policy);
+
+	static void GetRetryStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	v8::Local<v8::Value> GetRetryStats();
+
+	static void SetAdmissionLimitWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	void SetAdmissionLimit(const std::string& key, v8::Local<v8::Value> options);
+
+	static void GetAdmissionStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	v8::Local<v8::Value> GetAdmissionStats();
+
+	static void SetPriorityWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	void SetPriority(int priority);
+
+	static void SetBatchingWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+
 	static void PushRoleWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
 	void PushRole(const char* pathToRoleFile);
 
 	static void SubscriptionAddWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
 	void SubscriptionAdd(const char* key, LS2Message* msg);
 
+	static void SubscriptionReplyWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	void SubscriptionReply(const char* key, const char* payload);
+
+	static void SubscriberCountWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	uint32_t SubscriberCount(const char* key);
+
+	static void PublishWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	void Publish(const char* key, const char* payload);
+
+	static void SetPublishIntervalWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	void SetPublishInterval(int interval);
+
+	static void GetPublishStatsWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	v8::Local<v8::Value> GetPublishStats();
+
+	// Creates fPublisher on first use
+	LS2Publisher* Publisher();
+
 	// Common implmentation for Call, Watch and Subscribe
-	v8::Local<v8::Value> CallInternal(const char* busName, const char* payload, int responseLimit, const char* sessionId = NULL);
+	v8::Local<v8::Value> CallInternal(const char* busName, const char* payload, int responseLimit, const char* sessionId = NULL,
+	                                  const LS2CallOptions* options = NULL);
+	static void CallWithOptions(const v8::FunctionCallbackInfo<v8::Value>& args, int responseLimit);
 
    	// Glib integration
 	void Attach(GMainLoop *mainLoop);
@@ -95,9 +210,26 @@ private:
 	static bool RequestCallback(LSHandle *sh, LSMessage *message, void *ctx);
 	bool RequestArrived(LSMessage *message);
 
+	// Emits the request, or calls its handler
+	void DispatchRequest(LSMessage *message);
+
+	static bool AsyncResponseCallback(LSHandle *sh, LSMessage *message, void *ctx);
+	bool AsyncResponseArrived(LSMessage *message);
+	virtual void TimerExpired(uint64_t cookie);
+
+	// Rejects the promises of all pending callAsync() and callMany() calls
+	void RejectPendingCalls(const char* reason);
+
+	// The category name registered with LS2 for category, "/" when empty
+	static const char* CategoryName(const char* category);
+
+	// Key of fMethodHandlers
+	static std::string MethodKey(const char* category, const char* methodName);
+
 	static void SetAppId(const v8::FunctionCallbackInfo<v8::Value>& args);
 	static void checkCallerScriptPermissions(v8::Isolate* isolate);
-	static const std::string& findMyAppId(v8::Isolate* isolate);
+	static std::string findMyAppId(v8::Isolate* isolate);
+	static const std::string& resolveScriptAppId(const std::string& scriptName);
 	// Common routine called whenever a message arrives from the bus. Different symbols
 	// are used to differentiate requests, responses and cancelled subscriptions
 	//void EmitMessage(const v8::Handle<v8::String>& symbol, LSMessage *message);
@@ -109,23 +241,208 @@ private:
     LS2Handle( const LS2Handle& );
     const LS2Handle& operator=( const LS2Handle& );
 
-    // Helper class to manage the data structures LS2 requires for method registration.
-	class RegisteredMethod {
+    // Owns the LSMethod tables registered for one category. LS2 keeps pointers to
+    // the tables and the method names, so neither ever moves.
+	class CategoryArena {
 	public:
-		RegisteredMethod(const char* name);
-		LSMethod* GetMethods();
+		// Adds one contiguous table, terminated by an empty entry, for methodNames
+		LSMethod* AddTable(const std::vector<std::string>& methodNames);
 	private:
-		std::vector<char> fName;
-		LSMethod fMethods[2];
+		std::deque<std::string> fNames;
+		std::vector<std::unique_ptr<LSMethod[]> > fTables;
 	};
 
 	LSHandle* fHandle;
 
-	typedef std::vector<RegisteredMethod*> MethodVector;
-	MethodVector fRegisteredMethods;
+	typedef std::unordered_map<std::string, CategoryArena> CategoryMap;
+	CategoryMap fCategories;
+
+	std::unique_ptr<LS2Publisher> fPublisher;
+
+	// The calls of one callMany(), settled together
+	struct CallGroup {
+		v8::Global<v8::Promise::Resolver> fResolver;
+		v8::Global<v8::Array> fResults;  // one entry per call
+		size_t fNeeded;                  // completed calls that settle the promise
+		size_t fCompleted;
+		bool fSettled;
+		std::vector<LSMessageToken> fTokens;
+	};
+
+	// Another callAsync() waiting for the response of an identical call
+	struct CallWaiter {
+		uint64_t fId;
+		v8::Global<v8::Promise::Resolver> fResolver;
+		bool fParseJSON;
+		uint64_t fTimer;  // in the LS2TimerWheel, or 0
+	};
+
+	// A callAsync() waiting for its response, or a call of a callMany() waiting for
+	// its responses. The handle keeps a single Ref() for as long as any of them is
+	// pending.
+	struct PendingCall {
+		v8::Global<v8::Promise::Resolver> fResolver;  // callAsync() only
+		bool fParseJSON;
+		std::string fCacheKey;                        // cached calls only
+		std::vector<CallWaiter> fWaiters;
+		std::shared_ptr<CallGroup> fGroup;            // callMany() only
+		uint32_t fIndex;                              // in fGroup->fResults
+		int fResponseLimit;
+		int fResponseCount;
+		uint64_t fTimer;                              // in the LS2TimerWheel, or 0
+	};
+	typedef std::unordered_map<LSMessageToken, PendingCall> PendingCallMap;
+	PendingCallMap fPendingCalls;
+
+	void SettlePendingCall(PendingCallMap::iterator it, LSMessage *message);
+	void ForgetPendingCall(PendingCallMap::iterator it);
+
+	// Timer wheel cookies of CallWaiters with a timeout of their own
+	static const uint64_t kCallWaiterCookie = 1ull << 61;
+	std::unordered_map<uint64_t, LSMessageToken> fCallWaiterTokens;  // by CallWaiter id
+
+	void CallWaiterExpired(uint64_t id);
+	void ForgetCallWaiters(std::vector<CallWaiter>& waiters);
+
+	// One upstream subscription fanned out to every subscribe() of the same URI
+	// and payload made with the shared option
+	struct SharedSubscription {
+		std::string fKey;                   // CallCacheKey
+		LSMessage* fLast;                   // latest update, with a reference taken, or 0
+		std::vector<uint64_t> fSubscribers; // serial numbers of the Calls
+	};
+	std::unordered_map<LSMessageToken, SharedSubscription> fSharedSubscriptions;
+	std::unordered_map<std::string, LSMessageToken> fSharedTokens;        // by CallCacheKey
+
+	static bool SharedResponseCallback(LSHandle *sh, LSMessage *message, void *ctx);
+	bool SharedResponseArrived(LSMessage *message);
+
+	// Drops every shared subscription, without canceling them upstream
+	void ForgetSharedSubscriptions();
+
+	// A waitForService() promise, or a callAsync() held until its service is up
+	struct ServiceWaiter {
+		uint64_t fId;
+		v8::Global<v8::Promise::Resolver> fResolver;
+		uint64_t fTimer;        // in the LS2TimerWheel, or 0
+		uint64_t fExpires;      // uv_now(), 0 for none
+		bool fIsCall;
+		std::string fBusName;   // calls only
+		std::string fPayload;
+		bool fParseJSON;
+	};
+
+	// One LSRegisterServerStatusEx() watch, made on first use and kept until the
+	// handle is unregistered. The handle keeps a single Ref() while any exist.
+	struct ServiceWatch {
+		void* fCookie;
+		enum { kUnknown, kDown, kUp } fState;
+		std::vector<v8::Global<v8::Function> > fListeners;
+		std::vector<ServiceWaiter> fWaiters;
+	};
+	std::unordered_map<std::string, ServiceWatch> fServiceWatches;
+	std::unordered_map<uint64_t, std::string> fServiceWaiterNames;  // by ServiceWaiter id
+	uint64_t fNextWaiterId;
+
+	// Status changes reported by LS2, possibly on the bus thread, not yet handled
+	std::mutex fStatusMutex;
+	std::vector<std::pair<std::string, bool> > fStatusChanges;
+
+	// Listeners added while the status was known, given it on a later turn
+	std::vector<std::pair<std::string, v8::Global<v8::Function> > > fInitialStatus;
+
+	// Timer wheel cookies of ServiceWaiters have this bit set, call tokens don't
+	static const uint64_t kServiceWaiterCookie = 1ull << 63;
+
+	// A request waiting for an admission slot, with a reference taken
+	struct QueuedRequest {
+		uint64_t fId;
+		LSMessage* fMessage;
+		uint64_t fTimer;  // in the LS2TimerWheel, or 0
+	};
+
+	// Concurrency limit of the whole handle, or of one method
+	struct AdmissionLimit {
+		int fMaxConcurrent;
+		size_t fMaxQueued;
+		unsigned fMaxWait;         // ms, 0 for no limit
+		std::string fBusyPayload;  // answer to the requests turned away
+		int fActive;               // requests admitted and not answered yet
+		uint64_t fEpoch;           // tells this limit from one removed before
+		std::deque<QueuedRequest> fQueue;
+		uint64_t fAdmitted;
+		uint64_t fRejected;
+		uint64_t fExpired;
+	};
+	// By MethodKey, "" for the limit of the whole handle, which covers the
+	// methods without a limit of their own
+	std::unordered_map<std::string, AdmissionLimit> fAdmissionLimits;
+	std::unordered_map<uint64_t, std::string> fQueuedRequestKeys;  // by QueuedRequest id
+	uint64_t fNextRequestId;
+	uint64_t fNextAdmissionEpoch;
+
+	// Keys of the limits with freed slots, admitted from on a later loop turn
+	std::set<std::string> fAdmissionsPending;
+
+	// The handle and limit an admitted request holds a slot of
+	struct AdmissionTicket {
+		uint64_t fHandle;  // serial number
+		std::string fKey;
+		uint64_t fEpoch;
+	};
+	static thread_local std::unordered_map<LSMessage*, AdmissionTicket> tAdmittedRequests;
+
+	// Timer wheel cookies of QueuedRequests
+	static const uint64_t kQueuedRequestCookie = 1ull << 62;
+
+	void Admit(LSMessage *message, const std::string& key, AdmissionLimit& limit);
+	static void ReleaseAdmission(LSMessage *message);
+	void ScheduleAdmission(const std::string& key);
+	bool AdmissionArrived();
+	void AdmitQueuedRequests(const std::string& key);
+	void QueuedRequestExpired(uint64_t id);
+	void RespondBusy(LSMessage *message, const AdmissionLimit& limit);
+	void DropQueuedRequests();
+
+	// Default of call(), watch() and subscribe(), or NULL for no retries
+	std::shared_ptr<const LS2RetryPolicy> fRetryPolicy;
+	uint64_t fRetries;
+	uint64_t fRetriesExhausted;
+
+	ServiceWatch& WatchService(const std::string& serviceName);
+	ServiceWaiter& AddServiceWaiter(ServiceWatch& watch, const std::string& serviceName,
+	                                v8::Local<v8::Promise::Resolver> resolver, unsigned timeout);
+	static bool ServerStatusCallback(LSHandle *sh, const char *serviceName, bool connected, void *ctx);
+	bool ServiceStatusArrived();
+	void ServiceWaiterExpired(uint64_t id);
+
+	// Cancels the watches and rejects their waiters
+	void CancelServiceWatches(const char* reason);
+
+	static v8::Local<v8::Value> TimeoutError(v8::Isolate* isolate);
+
+	// Opt-in cache of callAsync() responses, per URI
+	struct CachedResponse {
+		std::string fPayload;
+		uint64_t fExpires;  // uv_hrtime()
+	};
+	std::unordered_map<std::string, uint64_t> fCallCacheTTLs;             // in ns, by URI
+	std::unordered_map<std::string, CachedResponse> fCallCache;           // by CallCacheKey
+	std::unordered_map<std::string, LSMessageToken> fCallsInFlight;       // by CallCacheKey
+	uint64_t fCacheHits;
+	uint64_t fCacheMisses;
+	uint64_t fCacheCoalesced;
+
+	// Handlers passed to registerMethod, by category and method
+	typedef std::unordered_map<std::string, v8::Global<v8::Function> > HandlerMap;
+	HandlerMap fMethodHandlers;
 
     typedef std::unordered_map<std::string, std::string> ServiceContainer;
 	static ServiceContainer fRegisteredServices;
+	// Application IDs resolved for script names by findMyAppId, empty when no
+	// service matched. Cleared whenever fRegisteredServices changes.
+	static ServiceContainer fScriptAppIds;
+	static std::mutex fRegisteredServicesMutex;
 };
 
 
@@ -0,0 +1,125 @@
+// Copyright (c) 2023 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include "node_ls2_histogram.h"
+
+#include <cstring>
+
+using namespace v8;
+
+LS2Histogram::LS2Histogram()
+{
+    Reset();
+}
+
+void LS2Histogram::Reset()
+{
+    std::memset(fBuckets, 0, sizeof(fBuckets));
+    fCount = 0;
+    fSum = 0;
+    fMin = 0;
+    fMax = 0;
+}
+
+void LS2Histogram::Record(uint64_t value)
+{
+    fBuckets[BucketIndex(value)]++;
+    if (fCount == 0 || value < fMin) {
+        fMin = value;
+    }
+    if (value > fMax) {
+        fMax = value;
+    }
+    fCount++;
+    fSum += value;
+}
+
+unsigned LS2Histogram::BucketIndex(uint64_t value)
+{
+    if (value < kSubBuckets) {
+        return value;
+    }
+    unsigned shift = (63 - __builtin_clzll(value)) - kSubBucketBits;
+    if (shift > kMaxShift) {
+        return kBuckets - 1;
+    }
+    return (shift + 1) * kSubBuckets + ((value >> shift) - kSubBuckets);
+}
+
+uint64_t LS2Histogram::BucketLowerBound(unsigned index)
+{
+    if (index < kSubBuckets) {
+        return index;
+    }
+    unsigned shift = index / kSubBuckets - 1;
+    return (uint64_t(index % kSubBuckets) + kSubBuckets) << shift;
+}
+
+uint64_t LS2Histogram::Percentile(double fraction) const
+{
+    if (fCount == 0) {
+        return 0;
+    }
+    uint64_t wanted = fraction * fCount;
+    if (wanted == 0) {
+        wanted = 1;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < kBuckets; ++i) {
+        seen += fBuckets[i];
+        if (seen >= wanted) {
+            uint64_t upper = i + 1 < kBuckets ? BucketLowerBound(i + 1) - 1 : fMax;
+            return upper < fMax ? upper : fMax;
+        }
+    }
+    return fMax;
+}
+
+Local<Object> LS2Histogram::ToJS(Isolate* isolate) const
+{
+    EscapableHandleScope scope(isolate);
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> result = Object::New(isolate);
+
+    struct { const char* name; double value; } fields[] = {
+        { "count", double(fCount) },
+        { "min", double(fMin) },
+        { "max", double(fMax) },
+        { "mean", fCount ? double(fSum) / fCount : 0.0 },
+        { "p50", double(Percentile(0.5)) },
+        { "p90", double(Percentile(0.9)) },
+        { "p99", double(Percentile(0.99)) },
+        { "p999", double(Percentile(0.999)) }
+    };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        result->Set(context, String::NewFromUtf8(isolate, fields[i].name).ToLocalChecked(),
+                    Number::New(isolate, fields[i].value)).Check();
+    }
+
+    Local<Array> buckets = Array::New(isolate);
+    uint32_t n = 0;
+    for (unsigned i = 0; i < kBuckets; ++i) {
+        if (fBuckets[i]) {
+            Local<Array> bucket = Array::New(isolate, 2);
+            bucket->Set(context, 0, Number::New(isolate, double(BucketLowerBound(i)))).Check();
+            bucket->Set(context, 1, Number::New(isolate, double(fBuckets[i]))).Check();
+            buckets->Set(context, n++, bucket).Check();
+        }
+    }
+    result->Set(context, String::NewFromUtf8(isolate, "buckets").ToLocalChecked(), buckets).Check();
+
+    return scope.Escape(result);
+}
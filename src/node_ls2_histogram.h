@@ -0,0 +1,60 @@
+// Copyright (c) 2023 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef NODE_LS2_HISTOGRAM_H
+#define NODE_LS2_HISTOGRAM_H
+
+#include <node.h>
+#include <stdint.h>
+
+// Log-linear histogram in the style of HdrHistogram: every power of two range
+// is split into kSubBuckets linear buckets, so any recorded value is known to
+// within 1/kSubBuckets. Recording is a few shifts and an increment.
+class LS2Histogram {
+public:
+	LS2Histogram();
+
+	void Record(uint64_t value);
+	void Reset();
+
+	uint64_t Count() const { return fCount; }
+
+	// Upper bound of the bucket holding the given fraction (0..1) of the values.
+	uint64_t Percentile(double fraction) const;
+
+	// Returns { count, min, max, mean, p50, p90, p99, p999, buckets } where
+	// buckets is an array of [lowerBound, count] pairs for the non-empty buckets.
+	v8::Local<v8::Object> ToJS(v8::Isolate* isolate) const;
+
+private:
+	enum {
+		kSubBucketBits = 4,
+		kSubBuckets = 1 << kSubBucketBits,
+		kMaxShift = 32,  // values above 2^(kMaxShift + kSubBucketBits) are clamped
+		kBuckets = (kMaxShift + 2) * kSubBuckets
+	};
+
+	static unsigned BucketIndex(uint64_t value);
+	static uint64_t BucketLowerBound(unsigned index);
+
+	uint64_t fBuckets[kBuckets];
+	uint64_t fCount;
+	uint64_t fSum;
+	uint64_t fMin;
+	uint64_t fMax;
+};
+
+#endif
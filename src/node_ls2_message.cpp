@@ -16,10 +16,14 @@
 
 #include "node_ls2_message.h"
 #include "node_ls2_error_wrapper.h"
+#include "node_ls2_handle.h"
 #include "node_ls2_utils.h"
 
 #include <syslog.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <vector>
 
 using namespace std;
 using namespace v8;
@@ -32,9 +36,81 @@ template <> v8::Local<v8::Value> ConvertToJS<LSMessageToken>(LSMessageToken v)
     return v8::Integer::NewFromUnsigned(v8::Isolate::GetCurrent(), v);
 }
 
+// Payloads at least this long are handed to V8 as external strings rather than
+// copied, when they are plain ASCII. Shorter ones are cheaper to copy.
+static const size_t kExternalPayloadThreshold = 1024;
+
+// Largest respondJSON() buffer kept for the next response
+static const size_t kMaxKeptResponseBuffer = 64 * 1024;
+
+// External string resource pointing straight at the payload buffer of an
+// LSMessage. Holds a reference on the message until V8 collects the string.
+class PayloadResource : public String::ExternalOneByteStringResource {
+public:
+    PayloadResource(LSMessage* message, const char* data, size_t length)
+        : fMessage(message)
+        , fData(data)
+        , fLength(length)
+    {
+        LSMessageRef(fMessage);
+    }
+
+    virtual ~PayloadResource()
+    {
+        LSMessageUnref(fMessage);
+    }
+
+    virtual const char* data() const { return fData; }
+    virtual size_t length() const { return fLength; }
+
+private:
+    // prevent copying
+    PayloadResource( const PayloadResource& );
+    const PayloadResource& operator=( const PayloadResource& );
+
+    LSMessage* fMessage;
+    const char* fData;
+    size_t fLength;
+};
+
+static bool IsAscii(const char* s, size_t length)
+{
+    for (size_t i = 0; i < length; ++i) {
+        if (static_cast<unsigned char>(s[i]) & 0x80) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // Need to hold on to a reference to the function template for use by
-// NewFromMessage.
-Persistent<FunctionTemplate> LS2Message::gMessageTemplate;
+// NewFromMessage. Per environment, as each worker has its own isolate.
+thread_local Persistent<FunctionTemplate> LS2Message::gMessageTemplate;
+thread_local Persistent<Function> LS2Message::gMessageFunction;
+
+// The fields returned by toObject(), in order. toObject() instantiates one
+// template that already has all of them, so every result has the same shape.
+enum {
+    kFieldMethod,
+    kFieldCategory,
+    kFieldKind,
+    kFieldSender,
+    kFieldSenderServiceName,
+    kFieldApplicationID,
+    kFieldUniqueToken,
+    kFieldToken,
+    kFieldResponseToken,
+    kFieldIsSubscription,
+    kFieldCount
+};
+
+static const char* const fieldNames[kFieldCount] = {
+    "method", "category", "kind", "sender", "senderServiceName", "applicationID",
+    "uniqueToken", "token", "responseToken", "isSubscription"
+};
+
+static thread_local Persistent<ObjectTemplate> gFieldsTemplate;
+static thread_local Persistent<String> gFieldNames[kFieldCount];
 
 // Called during add-on initialization to add the "Message" template function
 // to the target object.
@@ -53,6 +129,7 @@ void LS2Message::Initialize (Local<Object> target, v8::Local<v8::Context> contex
     t->InstanceTemplate()->SetInternalFieldCount(1);
 
     NODE_SET_PROTOTYPE_METHOD(t, "payload", PayloadWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "payloadJSON", PayloadJSONWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "responseToken", ResponseTokenWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "print", PrintWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "method", MethodWrapper);
@@ -65,10 +142,25 @@ void LS2Message::Initialize (Local<Object> target, v8::Local<v8::Context> contex
     NODE_SET_PROTOTYPE_METHOD(t, "token", TokenWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "isSubscription", IsSubscriptionWrapper);
     NODE_SET_PROTOTYPE_METHOD(t, "respond", RespondWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "respondJSON", RespondJSONWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "release", ReleaseWrapper);
+    NODE_SET_PROTOTYPE_METHOD(t, "toObject", ToObjectWrapper);
+
+    Local<ObjectTemplate> fields = ObjectTemplate::New(isolate);
+    for (int i = 0; i < kFieldCount; ++i) {
+        Local<String> name = String::NewFromUtf8(isolate, fieldNames[i],
+                                                 NewStringType::kInternalized).ToLocalChecked();
+        gFieldNames[i].Reset(isolate, name);
+        fields->Set(name, Undefined(isolate));
+    }
+    gFieldsTemplate.Reset(isolate, fields);
+
+    Local<Function> function = t->GetFunction(currentContext).ToLocalChecked();
+    gMessageFunction.Reset(isolate, function);
 
     target->Set(currentContext,
                 String::String::NewFromUtf8(isolate, "Message").ToLocalChecked(),
-                t->GetFunction(currentContext).ToLocalChecked());
+                function);
 }
 
 // Used by LSHandle to create a "Message" object that wraps a particular
@@ -76,9 +168,10 @@ void LS2Message::Initialize (Local<Object> target, v8::Local<v8::Context> contex
 Local<Value> LS2Message::NewFromMessage(LSMessage* message)
 {
     v8::Isolate* isolate = v8::Isolate::GetCurrent();
+
     Local<Context> currentContext = isolate->GetCurrentContext();
     TryCatch try_catch(isolate);
-    Local<Function> function = v8::Local<FunctionTemplate>::New(isolate, gMessageTemplate)->GetFunction(currentContext).ToLocalChecked();
+    Local<Function> function = Local<Function>::New(isolate, gMessageFunction);
     Local<Object> messageObject = function->NewInstance(currentContext).ToLocalChecked();
 
     // If we get an exception in LS2Message::New, then it will return
@@ -103,6 +196,20 @@ Local<Value> LS2Message::NewFromMessage(LSMessage* message)
     return messageObject;
 }
 
+Local<Value> LS2Message::NewForError(const char* method, const char* payload, LSMessageToken responseToken)
+{
+    Local<Value> messageObject = NewFromMessage(0);
+    if (!messageObject->IsObject()) {
+        return messageObject;
+    }
+    LS2Message *m = node::ObjectWrap::Unwrap<LS2Message>(Local<Object>::Cast(messageObject));
+    m->fError.reset(new ErrorResponse);
+    m->fError->fMethod = method;
+    m->fError->fPayload = payload;
+    m->fError->fResponseToken = responseToken;
+    return messageObject;
+}
+
 LSMessage* LS2Message::Get() const
 {
     RequireMessage();
@@ -145,13 +252,18 @@ LS2Message::~LS2Message()
     cerr << "LS2Message::~LS2Message()" << endl;
 #endif
     if(fMessage) {
+        LS2Handle::RequestFinished(fMessage);
         LSMessageUnref(fMessage);
     }
 }
 
 void LS2Message::SetMessage(LSMessage* m)
 {
+    fPayload.Reset();
+    fPayloadJSON.Reset();
+    fError.reset();
     if(fMessage) {
+        LS2Handle::RequestFinished(fMessage);
         LSMessageUnref(fMessage);
     }
     fMessage = m;
@@ -187,6 +299,9 @@ void LS2Message::IsSubscriptionWrapper(const v8::FunctionCallbackInfo<v8::Value>
 
 bool LS2Message::IsSubscription() const
 {
+    if (fError) {
+        return false;
+    }
     RequireMessage();
     return LSMessageIsSubscription(fMessage);
 }
@@ -213,12 +328,69 @@ const char* LS2Message::Method() const
 
 void LS2Message::PayloadWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
-    MemberFunctionWrapper<LS2Message, const char*>(&LS2Message::Payload, args);
+    MemberFunctionWrapper<LS2Message, Local<Value> >(&LS2Message::Payload, args);
+}
+
+Local<Value> LS2Message::Payload()
+{
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    if (!fPayload.IsEmpty()) {
+        return fPayload.Get(isolate);
+    }
+
+    const char* payload = GetString(LSMessageGetPayload);
+    size_t length = strlen(payload);
+    Local<String> result;
+    if (fMessage && length >= kExternalPayloadThreshold && IsAscii(payload, length)) {
+        PayloadResource* resource = new PayloadResource(fMessage, payload, length);
+        if (!String::NewExternalOneByte(isolate, resource).ToLocal(&result)) {
+            delete resource;
+            throw runtime_error("Unable to create payload string.");
+        }
+    } else if (!String::NewFromUtf8(isolate, payload, NewStringType::kNormal, length).ToLocal(&result)) {
+        throw runtime_error("Unable to create payload string.");
+    }
+    fPayload.Reset(isolate, result);
+    return result;
+}
+
+// Turns the exception caught by tryCatch into a C++ exception, for the wrapper
+// to rethrow as an Error
+static void ThrowCaught(Isolate* isolate, const TryCatch& tryCatch, const char* what)
+{
+    std::string message(what);
+    if (tryCatch.HasCaught()) {
+        String::Utf8Value exception(isolate, tryCatch.Exception());
+        if (*exception) {
+            message += ": ";
+            message += *exception;
+        }
+    }
+    throw runtime_error(message);
+}
+
+void LS2Message::PayloadJSONWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    MemberFunctionWrapper<LS2Message, Local<Value> >(&LS2Message::PayloadJSON, args);
 }
 
-const char* LS2Message::Payload() const
+// Parses the payload string, which for large payloads points straight into the
+// message buffer, so the payload is never copied to the V8 heap.
+Local<Value> LS2Message::PayloadJSON()
 {
-    return GetString(LSMessageGetPayload);
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    if (!fPayloadJSON.IsEmpty()) {
+        return fPayloadJSON.Get(isolate);
+    }
+
+    Local<String> payload = Local<String>::Cast(Payload());
+    TryCatch tryCatch(isolate);
+    Local<Value> result;
+    if (!JSON::Parse(isolate->GetCurrentContext(), payload).ToLocal(&result)) {
+        ThrowCaught(isolate, tryCatch, "Invalid JSON payload");
+    }
+    fPayloadJSON.Reset(isolate, result);
+    return result;
 }
 
 void LS2Message::PrintWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
@@ -228,10 +400,27 @@ void LS2Message::PrintWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 
 void LS2Message::Print() const
 {
+    if (fError) {
+        fprintf(stderr, "%s/%s %s\n", LUNABUS_ERROR_CATEGORY, fError->fMethod.c_str(), fError->fPayload.c_str());
+        return;
+    }
     RequireMessage();
     LSMessagePrint(fMessage, stderr);
 }
 
+void LS2Message::ReleaseWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    VoidMemberFunctionWrapper<LS2Message>(&LS2Message::Release, args);
+}
+
+// Drops the reference on the LSMessage now rather than when the object is
+// collected. The object is not reused: JS may still hold it, with properties
+// of its own, so handing it to another request would alias the two.
+void LS2Message::Release()
+{
+    SetMessage(0);
+}
+
 void LS2Message::RespondWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
     MemberFunctionWrapper<LS2Message, bool, const char*>(&LS2Message::Respond, args);
@@ -245,9 +434,42 @@ bool LS2Message::Respond(const char* payload) const
         err.ThrowError();
         return false;
     }
+    LS2Handle::RequestFinished(fMessage);
     return true;
 }
 
+void LS2Message::RespondJSONWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    MemberFunctionWrapper<LS2Message, bool, Local<Value> >(&LS2Message::RespondJSON, args);
+}
+
+bool LS2Message::RespondJSON(Local<Value> response) const
+{
+    RequireMessage();
+    if (!response->IsObject()) {
+        throw runtime_error("Response must be an object");
+    }
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    TryCatch tryCatch(isolate);
+    Local<String> json;
+    if (!JSON::Stringify(isolate->GetCurrentContext(), response).ToLocal(&json)) {
+        ThrowCaught(isolate, tryCatch, "Unable to serialize response");
+    }
+
+    // Encoded straight into a buffer kept from one response to the next. Larger
+    // responses get a buffer of their own, so that one of them doesn't pin its
+    // memory for the life of the thread.
+    static thread_local std::vector<char> buffer;
+    std::vector<char> large;
+    size_t length = json->Utf8Length(isolate);
+    std::vector<char>& target = (length < kMaxKeptResponseBuffer) ? buffer : large;
+    if (target.size() < length + 1) {
+        target.resize(length + 1);
+    }
+    json->WriteUtf8(isolate, target.data(), int(length + 1), NULL, String::REPLACE_INVALID_UTF8);
+    return Respond(target.data());
+}
+
 void LS2Message::ResponseTokenWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
     MemberFunctionWrapper<LS2Message, LSMessageToken>(&LS2Message::ResponseToken, args);
@@ -298,8 +520,50 @@ const char* LS2Message::UniqueToken() const
     return GetString(LSMessageGetUniqueToken);
 }
 
+void LS2Message::ToObjectWrapper(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    MemberFunctionWrapper<LS2Message, Local<Value> >(&LS2Message::ToObject, args);
+}
+
+// All the metadata accessors in one call
+Local<Value> LS2Message::ToObject() const
+{
+    v8::Isolate* isolate = v8::Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> result = Local<ObjectTemplate>::New(isolate, gFieldsTemplate)->NewInstance(context).ToLocalChecked();
+
+    Local<Value> values[kFieldCount];
+    values[kFieldMethod] = ConvertToJS<const char*>(Method());
+    values[kFieldCategory] = ConvertToJS<const char*>(Category());
+    values[kFieldKind] = ConvertToJS<const char*>(Kind());
+    values[kFieldSender] = ConvertToJS<const char*>(Sender());
+    values[kFieldSenderServiceName] = ConvertToJS<const char*>(SenderServiceName());
+    values[kFieldApplicationID] = ConvertToJS<const char*>(ApplicationID());
+    values[kFieldUniqueToken] = ConvertToJS<const char*>(UniqueToken());
+    values[kFieldToken] = ConvertToJS<LSMessageToken>(Token());
+    values[kFieldResponseToken] = ConvertToJS<LSMessageToken>(ResponseToken());
+    values[kFieldIsSubscription] = ConvertToJS<bool>(IsSubscription());
+
+    for (int i = 0; i < kFieldCount; ++i) {
+        result->Set(context, Local<String>::New(isolate, gFieldNames[i]), values[i]).Check();
+    }
+    return result;
+}
+
 const char* LS2Message::GetString(StringGetterFunction f) const
 {
+    if (fError) {
+        if (f == LSMessageGetCategory) {
+            return LUNABUS_ERROR_CATEGORY;
+        }
+        if (f == LSMessageGetMethod) {
+            return fError->fMethod.c_str();
+        }
+        if (f == LSMessageGetPayload) {
+            return fError->fPayload.c_str();
+        }
+        return "";
+    }
     RequireMessage();
 
     const char* s = (*f)(fMessage);
@@ -311,6 +575,9 @@ const char* LS2Message::GetString(StringGetterFunction f) const
 
 LSMessageToken LS2Message::GetToken(TokenGetterFunction f) const
 {
+    if (fError) {
+        return f == LSMessageGetResponseToken ? fError->fResponseToken : LSMESSAGE_TOKEN_INVALID;
+    }
     RequireMessage();
     return (*f)(fMessage);
 }
@@ -22,6 +22,7 @@
 #include <luna-service2/lunaservice.h>
 #include <node.h>
 #include <node_object_wrap.h>
+#include <memory>
 #include <string>
 
 struct LSMessage;
@@ -36,6 +37,12 @@ public:
 	// Create a "Message" JavaScript object and wrap it around the C++ LSMessage object.
 	static v8::Local<v8::Value> NewFromMessage(LSMessage*);
 
+	// Create a "Message" object for an error response that did not come from the
+	// bus, such as a call running out of time. It reports the bus error category,
+	// method and payload like one that did, and can't be responded to.
+	static v8::Local<v8::Value> NewForError(const char* method, const char* payload,
+	                                        LSMessageToken responseToken);
+
 	LSMessage* Get() const;
 
 protected:
@@ -71,14 +78,23 @@ private:
 	const char* Method() const;
 
 	static void PayloadWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
-	const char* Payload() const;
+	v8::Local<v8::Value> Payload();
+
+	static void PayloadJSONWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	v8::Local<v8::Value> PayloadJSON();
 
 	static void PrintWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
 	void Print() const;
 
+	static void ReleaseWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	void Release();
+
 	static void RespondWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
 	bool Respond(const char* payload) const;
 
+	static void RespondJSONWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	bool RespondJSON(v8::Local<v8::Value> response) const;
+
 	static void ResponseTokenWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
 	LSMessageToken ResponseToken() const;
 
@@ -94,6 +110,9 @@ private:
 	static void UniqueTokenWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
 	const char* UniqueToken() const;
 
+	static void ToObjectWrapper(const v8::FunctionCallbackInfo<v8::Value>& args);
+	v8::Local<v8::Value> ToObject() const;
+
 	// Wrapper around an LSMessage string getter function that will throw an
 	// exception if fMessage is null and also return an empty string if the
 	// lower level accessor returns 0.
@@ -113,7 +132,23 @@ private:
     const LS2Message& operator=( const LS2Message& );
 
 	LSMessage* fMessage;
-	static v8::Persistent<v8::FunctionTemplate> gMessageTemplate;
+
+	// The response made up by NewForError(), with fMessage 0
+	struct ErrorResponse {
+		std::string fMethod;
+		std::string fPayload;
+		LSMessageToken fResponseToken;
+	};
+	std::unique_ptr<ErrorResponse> fError;
+
+	// The string returned by payload(), created on first use
+	v8::Global<v8::String> fPayload;
+
+	// The value returned by payloadJSON(), parsed on first use
+	v8::Global<v8::Value> fPayloadJSON;
+
+	static thread_local v8::Persistent<v8::FunctionTemplate> gMessageTemplate;
+	static thread_local v8::Persistent<v8::Function> gMessageFunction;
 };
 
 // Converter for LS2Message objects that converts a wrapped object to its native
@@ -0,0 +1,95 @@
+// Copyright (c) 2023 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef NODE_LS2_MESSAGE_QUEUE_H
+#define NODE_LS2_MESSAGE_QUEUE_H
+
+#include <atomic>
+#include <cstdint>
+
+#include <luna-service2/lunaservice.h>
+
+// A message handed from the thread that dispatched it to the JS thread.
+// fTarget is the serial number of the receiving LS2Base object rather than a
+// pointer, so that a message queued for an object that has since been collected
+// is simply dropped.
+struct QueuedMessage {
+    uint64_t fTarget;
+    int fKind;
+    LSMessage* fMessage;
+    std::atomic<QueuedMessage*> fNext;
+};
+
+// Intrusive multi-producer/single-consumer queue (Vyukov). Push() may be called
+// from any thread and never blocks; Pop() must only be called from the single
+// consumer thread.
+class MessageQueue {
+public:
+    MessageQueue()
+        : fHead(&fStub)
+        , fTail(&fStub)
+    {
+        fStub.fNext.store(nullptr, std::memory_order_relaxed);
+    }
+
+    void Push(QueuedMessage* item)
+    {
+        item->fNext.store(nullptr, std::memory_order_relaxed);
+        QueuedMessage* prev = fHead.exchange(item, std::memory_order_acq_rel);
+        prev->fNext.store(item, std::memory_order_release);
+    }
+
+    // Returns 0 when the queue is empty, or when a producer is half-way through
+    // a Push(); in the latter case the producer will signal again.
+    QueuedMessage* Pop()
+    {
+        QueuedMessage* tail = fTail;
+        QueuedMessage* next = tail->fNext.load(std::memory_order_acquire);
+        if (tail == &fStub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            fTail = next;
+            tail = next;
+            next = next->fNext.load(std::memory_order_acquire);
+        }
+        if (next) {
+            fTail = next;
+            return tail;
+        }
+        if (tail != fHead.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        Push(&fStub);
+        next = tail->fNext.load(std::memory_order_acquire);
+        if (next) {
+            fTail = next;
+            return tail;
+        }
+        return nullptr;
+    }
+
+private:
+    // prevent copying
+    MessageQueue( const MessageQueue& );
+    const MessageQueue& operator=( const MessageQueue& );
+
+    std::atomic<QueuedMessage*> fHead;
+    QueuedMessage* fTail;
+    QueuedMessage fStub;
+};
+
+#endif
@@ -0,0 +1,199 @@
+// Copyright (c) 2023 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include "node_ls2_publisher.h"
+#include "node_ls2_error_wrapper.h"
+
+#include <iostream>
+#include <stdexcept>
+
+using namespace v8;
+
+LS2Publisher::LS2Publisher(Isolate* isolate, LSHandle* handle)
+    : fIsolate(isolate)
+    , fHandle(handle)
+    , fLoop(node::GetCurrentEventLoop(isolate))
+    , fTimer(new uv_timer_t)
+    , fInterval(0)
+    , fPendingCount(0)
+    , fPublished(0)
+    , fSent(0)
+    , fDropped(0)
+{
+    uv_timer_init(fLoop, fTimer);
+    fTimer->data = this;
+    node::AddEnvironmentCleanupHook(fIsolate, CleanupHook, this);
+}
+
+LS2Publisher::~LS2Publisher()
+{
+    if (fTimer) {
+        node::RemoveEnvironmentCleanupHook(fIsolate, CleanupHook, this);
+        CloseTimer();
+    }
+}
+
+void LS2Publisher::SetInterval(unsigned interval)
+{
+    fInterval = interval;
+    if (fInterval == 0) {
+        Flush();
+    }
+}
+
+void LS2Publisher::Publish(const char* key, const char* payload)
+{
+    fPublished++;
+    if (fInterval == 0 || !fTimer) {
+        Send(key, payload);
+        return;
+    }
+
+    Entry& entry = fEntries[key];
+    uint64_t now = uv_now(fLoop);
+    if (entry.fPending) {
+        // Replaces the update still waiting
+        fDropped++;
+        entry.fPayload = payload;
+        return;
+    }
+    if (entry.fLastSent == 0 || now - entry.fLastSent >= fInterval) {
+        entry.fLastSent = now;
+        Send(key, payload);
+        // Wakes up once the key is idle again so its entry gets pruned
+        if (!uv_is_active((uv_handle_t*) fTimer)) {
+            uv_timer_start(fTimer, TimerCallback, fInterval, 0);
+        }
+        return;
+    }
+    entry.fPayload = payload;
+    entry.fPending = true;
+    fPendingCount++;
+    if (!uv_is_active((uv_handle_t*) fTimer)) {
+        uv_timer_start(fTimer, TimerCallback, entry.fLastSent + fInterval - now, 0);
+    }
+}
+
+void LS2Publisher::Cancel()
+{
+    fEntries.clear();
+    fPendingCount = 0;
+    if (fTimer) {
+        uv_timer_stop(fTimer);
+    }
+}
+
+Local<Object> LS2Publisher::Stats(Isolate* isolate) const
+{
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> result = Object::New(isolate);
+    result->Set(context, String::NewFromUtf8(isolate, "interval").ToLocalChecked(),
+                Number::New(isolate, fInterval)).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "published").ToLocalChecked(),
+                Number::New(isolate, fPublished)).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "sent").ToLocalChecked(),
+                Number::New(isolate, fSent)).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "dropped").ToLocalChecked(),
+                Number::New(isolate, fDropped)).Check();
+    result->Set(context, String::NewFromUtf8(isolate, "pending").ToLocalChecked(),
+                Number::New(isolate, fPendingCount)).Check();
+    return result;
+}
+
+void LS2Publisher::Send(const std::string& key, const char* payload)
+{
+    LSErrorWrapper err;
+    if (!LSSubscriptionReply(fHandle, key.c_str(), payload, err)) {
+        err.ThrowError();
+    }
+    fSent++;
+}
+
+// Sends the waiting updates that are due and prunes the keys that have been
+// idle for a whole interval, then rearms the timer for the rest
+void LS2Publisher::Flush()
+{
+    uint64_t now = uv_now(fLoop);
+    uint64_t nextDue = 0;
+    EntryMap::iterator i = fEntries.begin();
+    while (i != fEntries.end()) {
+        Entry& entry = i->second;
+        uint64_t due = entry.fLastSent + fInterval;
+        if (fInterval && due > now) {
+            // Still holding off, either to send the waiting update or to
+            // throttle the next one
+            if (nextDue == 0 || due < nextDue) {
+                nextDue = due;
+            }
+            ++i;
+            continue;
+        }
+        if (!entry.fPending) {
+            // Nothing sent for a whole interval: a new update goes out right
+            // away, same as for a key never seen
+            i = fEntries.erase(i);
+            continue;
+        }
+        entry.fPending = false;
+        entry.fLastSent = now;
+        fPendingCount--;
+        LSErrorWrapper err;
+        if (LSSubscriptionReply(fHandle, i->first.c_str(), entry.fPayload.c_str(), err)) {
+            fSent++;
+        } else {
+            // Called from the timer, there is nobody to throw to
+            std::cerr << "Warning: LSSubscriptionReply failed for a coalesced update." << std::endl;
+            err.Print();
+        }
+        std::string().swap(entry.fPayload);
+        if (fInterval) {
+            if (nextDue == 0 || now + fInterval < nextDue) {
+                nextDue = now + fInterval;
+            }
+            ++i;
+        } else {
+            i = fEntries.erase(i);
+        }
+    }
+    if (nextDue && fTimer) {
+        uv_timer_start(fTimer, TimerCallback, nextDue - now, 0);
+    }
+}
+
+void LS2Publisher::TimerCallback(uv_timer_t* timer)
+{
+    static_cast<LS2Publisher*>(timer->data)->Flush();
+}
+
+void LS2Publisher::CloseCallback(uv_handle_t* handle)
+{
+    delete reinterpret_cast<uv_timer_t*>(handle);
+}
+
+void LS2Publisher::CloseTimer()
+{
+    uv_close((uv_handle_t*) fTimer, CloseCallback);
+    fTimer = 0;
+}
+
+// The environment is going away before the handle: close the timer while its
+// loop is still around
+void LS2Publisher::CleanupHook(void* arg)
+{
+    LS2Publisher* publisher = static_cast<LS2Publisher*>(arg);
+    publisher->Cancel();
+    publisher->CloseTimer();
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2023 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef NODE_LS2_PUBLISHER_H
+#define NODE_LS2_PUBLISHER_H
+
+#include <luna-service2/lunaservice.h>
+#include <node.h>
+#include <uv.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+// Publishes to the subscribers of a key through LSSubscriptionReply, sending at
+// most one update per key every interval ms. An update published while the key
+// is holding off replaces the one waiting to be sent, so subscribers always get
+// the newest value and the ones in between are dropped.
+class LS2Publisher {
+public:
+	LS2Publisher(v8::Isolate* isolate, LSHandle* handle);
+	~LS2Publisher();
+
+	// 0 sends every update right away
+	void SetInterval(unsigned interval);
+
+	void Publish(const char* key, const char* payload);
+
+	// Drops the waiting updates, e.g. when the handle is unregistered
+	void Cancel();
+
+	// Returns { interval, published, sent, dropped, pending }
+	v8::Local<v8::Object> Stats(v8::Isolate* isolate) const;
+
+private:
+	struct Entry {
+		std::string fPayload;
+		bool fPending;
+		uint64_t fLastSent;  // uv_now() of the last update sent
+	};
+
+	static void TimerCallback(uv_timer_t* timer);
+	static void CloseCallback(uv_handle_t* handle);
+	static void CleanupHook(void* arg);
+
+	void Send(const std::string& key, const char* payload);
+	void Flush();
+	void CloseTimer();
+
+	// prevent copying
+	LS2Publisher( const LS2Publisher& );
+	const LS2Publisher& operator=( const LS2Publisher& );
+
+	v8::Isolate* fIsolate;
+	LSHandle* fHandle;
+	uv_loop_t* fLoop;
+	uv_timer_t* fTimer;  // 0 once closed by the environment cleanup
+	unsigned fInterval;
+	unsigned fPendingCount;
+
+	typedef std::unordered_map<std::string, Entry> EntryMap;
+	EntryMap fEntries;
+
+	uint64_t fPublished;
+	uint64_t fSent;
+	uint64_t fDropped;
+};
+
+#endif
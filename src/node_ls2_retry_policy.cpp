@@ -0,0 +1,118 @@
+// Copyright (c) 2023 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include "node_ls2_retry_policy.h"
+
+#include <luna-service2/lunaservice.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+using namespace v8;
+
+// Older luna-service2 headers don't name the bus errors
+#ifndef LUNABUS_ERROR_SERVICE_NOT_EXISTS
+#define LUNABUS_ERROR_SERVICE_NOT_EXISTS "ServiceNotExist"
+#endif
+#ifndef LUNABUS_ERROR_SERVICE_DOWN
+#define LUNABUS_ERROR_SERVICE_DOWN "ServiceDown"
+#endif
+
+LS2RetryPolicy::LS2RetryPolicy()
+    : fMaxAttempts(3)
+    , fInitialDelay(100)
+    , fMaxDelay(10000)
+    , fMultiplier(2)
+    , fJitter(1)
+{
+    // The errors of a service that is not up yet or is restarting
+    fRetryOn.push_back(LUNABUS_ERROR_SERVICE_NOT_EXISTS);
+    fRetryOn.push_back(LUNABUS_ERROR_SERVICE_DOWN);
+}
+
+std::shared_ptr<const LS2RetryPolicy> LS2RetryPolicy::FromJS(Local<Value> value)
+{
+    if (value->IsNull() || value->IsFalse()) {
+        return std::shared_ptr<const LS2RetryPolicy>();
+    }
+    std::shared_ptr<LS2RetryPolicy> policy(new LS2RetryPolicy);
+    if (value->IsTrue()) {
+        return policy;
+    }
+    if (!value->IsObject()) {
+        throw std::runtime_error("Retry policy must be an object");
+    }
+    Isolate* isolate = Isolate::GetCurrent();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> options = Local<Object>::Cast(value);
+
+    Local<Value> field = options->Get(context, String::NewFromUtf8(isolate, "maxAttempts").ToLocalChecked()).ToLocalChecked();
+    if (!field->IsUndefined()) {
+        policy->fMaxAttempts = field->Int32Value(context).FromJust();
+        if (policy->fMaxAttempts < 1) {
+            throw std::runtime_error("maxAttempts must be at least 1");
+        }
+    }
+    field = options->Get(context, String::NewFromUtf8(isolate, "initialDelay").ToLocalChecked()).ToLocalChecked();
+    if (!field->IsUndefined()) {
+        policy->fInitialDelay = field->NumberValue(context).FromJust();
+    }
+    field = options->Get(context, String::NewFromUtf8(isolate, "maxDelay").ToLocalChecked()).ToLocalChecked();
+    if (!field->IsUndefined()) {
+        policy->fMaxDelay = field->NumberValue(context).FromJust();
+    }
+    field = options->Get(context, String::NewFromUtf8(isolate, "multiplier").ToLocalChecked()).ToLocalChecked();
+    if (!field->IsUndefined()) {
+        policy->fMultiplier = field->NumberValue(context).FromJust();
+    }
+    field = options->Get(context, String::NewFromUtf8(isolate, "jitter").ToLocalChecked()).ToLocalChecked();
+    if (!field->IsUndefined()) {
+        policy->fJitter = field->NumberValue(context).FromJust();
+    }
+    if (!(policy->fInitialDelay >= 0) || !(policy->fMaxDelay >= 0) || !(policy->fMultiplier >= 1)
+            || !(policy->fJitter >= 0 && policy->fJitter <= 1)) {
+        throw std::runtime_error("Invalid retry policy");
+    }
+    field = options->Get(context, String::NewFromUtf8(isolate, "retryOn").ToLocalChecked()).ToLocalChecked();
+    if (!field->IsUndefined()) {
+        if (!field->IsArray()) {
+            throw std::runtime_error("retryOn must be an array of error methods");
+        }
+        Local<Array> methods = Local<Array>::Cast(field);
+        policy->fRetryOn.clear();
+        for (uint32_t i = 0; i < methods->Length(); ++i) {
+            String::Utf8Value method(isolate, methods->Get(context, i).ToLocalChecked());
+            policy->fRetryOn.push_back(*method ? *method : "");
+        }
+    }
+    return policy;
+}
+
+bool LS2RetryPolicy::IsRetryable(const char* errorMethod) const
+{
+    return errorMethod && std::find(fRetryOn.begin(), fRetryOn.end(), errorMethod) != fRetryOn.end();
+}
+
+unsigned LS2RetryPolicy::Delay(int attempts) const
+{
+    static thread_local std::mt19937 generator{std::random_device()()};
+    double delay = std::min(fMaxDelay, fInitialDelay * std::pow(fMultiplier, attempts - 1));
+    std::uniform_real_distribution<double> fraction(0, fJitter);
+    delay -= delay * fraction(generator);
+    return static_cast<unsigned>(delay);
+}
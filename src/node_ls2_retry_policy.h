@@ -0,0 +1,50 @@
+// Copyright (c) 2023 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef NODE_LS2_RETRY_POLICY_H
+#define NODE_LS2_RETRY_POLICY_H
+
+#include <node.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// When and how often a call that failed with a bus error is made again. The
+// delay before attempt n + 1 is initialDelay * multiplier^(n - 1), capped at
+// maxDelay, of which a random fraction up to jitter is taken off so that
+// callers failing together don't all come back together.
+class LS2RetryPolicy {
+public:
+	LS2RetryPolicy();
+
+	// Reads {maxAttempts, initialDelay, maxDelay, multiplier, jitter, retryOn}.
+	// Returns NULL for a value of false or null, meaning no retries.
+	static std::shared_ptr<const LS2RetryPolicy> FromJS(v8::Local<v8::Value> value);
+
+	bool IsRetryable(const char* errorMethod) const;
+
+	// Milliseconds to wait after the given number of failed attempts
+	unsigned Delay(int attempts) const;
+
+	int fMaxAttempts;      // including the first one
+	double fInitialDelay;  // ms
+	double fMaxDelay;      // ms
+	double fMultiplier;
+	double fJitter;        // 0 to 1
+	std::vector<std::string> fRetryOn;  // error methods
+};
+
+#endif
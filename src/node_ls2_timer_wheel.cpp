@@ -0,0 +1,150 @@
+// Copyright (c) 2023 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include "node_ls2_timer_wheel.h"
+#include "node_ls2_base.h"
+
+using namespace v8;
+
+static thread_local LS2TimerWheel* tWheel = 0;
+
+LS2TimerWheel* LS2TimerWheel::Current()
+{
+    if (!tWheel) {
+        tWheel = new LS2TimerWheel(Isolate::GetCurrent());
+    }
+    return tWheel;
+}
+
+LS2TimerWheel::LS2TimerWheel(Isolate* isolate)
+    : fLoop(node::GetCurrentEventLoop(isolate))
+    , fTimer(new uv_timer_t)
+    , fSlots(kSlots)
+    , fNow(0)
+    , fCurrent(0)
+    , fNextId(1)
+{
+    uv_timer_init(fLoop, fTimer);
+    fTimer->data = this;
+    // Pending deadlines alone don't keep the process alive
+    uv_unref((uv_handle_t*) fTimer);
+    node::AddEnvironmentCleanupHook(isolate, CleanupHook, this);
+}
+
+LS2TimerWheel::~LS2TimerWheel()
+{
+    uv_close((uv_handle_t*) fTimer, CloseCallback);
+}
+
+uint64_t LS2TimerWheel::Add(unsigned delay, uint64_t serial, uint64_t cookie)
+{
+    if (fSlotOf.empty()) {
+        // Idle until now, move the wheel to the present
+        uv_update_time(fLoop);
+        fNow = uv_now(fLoop);
+        uv_timer_start(fTimer, TimerCallback, kTick, kTick);
+    }
+
+    Entry entry;
+    entry.fId = fNextId++;
+    entry.fSerial = serial;
+    entry.fCookie = cookie;
+    entry.fExpires = uv_now(fLoop) + delay;
+
+    // Timers further out than one turn wait in their slot for the right turn
+    uint64_t ticks = (entry.fExpires > fNow) ? (entry.fExpires - fNow + kTick - 1) / kTick : 1;
+    unsigned slot = (fCurrent + ticks) % kSlots;
+    fSlots[slot].push_back(entry);
+    fSlotOf[entry.fId] = slot;
+    return entry.fId;
+}
+
+void LS2TimerWheel::Cancel(uint64_t id)
+{
+    std::unordered_map<uint64_t, unsigned>::iterator it = fSlotOf.find(id);
+    if (it == fSlotOf.end()) {
+        return;
+    }
+    std::vector<Entry>& slot = fSlots[it->second];
+    for (size_t i = 0; i < slot.size(); ++i) {
+        if (slot[i].fId == id) {
+            slot[i] = slot.back();
+            slot.pop_back();
+            break;
+        }
+    }
+    fSlotOf.erase(it);
+    if (fSlotOf.empty()) {
+        uv_timer_stop(fTimer);
+    }
+}
+
+// Advances the wheel to uv_now(), firing the timers of every slot passed
+void LS2TimerWheel::Expire()
+{
+    uint64_t now = uv_now(fLoop);
+    std::vector<Entry> expired;
+    while (fNow + kTick <= now) {
+        fNow += kTick;
+        fCurrent = (fCurrent + 1) % kSlots;
+        std::vector<Entry>& slot = fSlots[fCurrent];
+        for (size_t i = 0; i < slot.size(); ) {
+            if (slot[i].fExpires <= now) {
+                expired.push_back(slot[i]);
+                fSlotOf.erase(slot[i].fId);
+                slot[i] = slot.back();
+                slot.pop_back();
+            } else {
+                ++i;
+            }
+        }
+    }
+    if (fSlotOf.empty()) {
+        uv_timer_stop(fTimer);
+    }
+
+    if (expired.empty()) {
+        return;
+    }
+    HandleScope scope(Isolate::GetCurrent());
+    for (size_t i = 0; i < expired.size(); ++i) {
+        LS2Base* target = LS2Base::FromSerial(expired[i].fSerial);
+        if (target) {
+            target->TimerExpired(expired[i].fCookie);
+        }
+    }
+    // Not a dispatch cycle, which would otherwise emit what the timers batched
+    LS2Base::FlushBatches();
+}
+
+void LS2TimerWheel::TimerCallback(uv_timer_t* timer)
+{
+    static_cast<LS2TimerWheel*>(timer->data)->Expire();
+}
+
+void LS2TimerWheel::CloseCallback(uv_handle_t* handle)
+{
+    delete reinterpret_cast<uv_timer_t*>(handle);
+}
+
+void LS2TimerWheel::CleanupHook(void* arg)
+{
+    LS2TimerWheel* wheel = static_cast<LS2TimerWheel*>(arg);
+    if (tWheel == wheel) {
+        tWheel = 0;
+    }
+    delete wheel;
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2023 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef NODE_LS2_TIMER_WHEEL_H
+#define NODE_LS2_TIMER_WHEEL_H
+
+#include <node.h>
+#include <uv.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+// Hashed timer wheel for the deadlines of outstanding calls. All of them share a
+// single uv timer, which only runs while there is something to expire. Adding
+// and canceling are O(1) on average, whatever the number of timers.
+//
+// Timers target LS2Base objects by serial number, so a timer whose object has
+// been collected in the meantime simply does nothing. On expiry the object's
+// TimerExpired() is called with the cookie given to Add().
+class LS2TimerWheel {
+public:
+	// The wheel of the calling thread's environment, created on first use.
+	static LS2TimerWheel* Current();
+
+	// Returns an id for Cancel(), never 0.
+	uint64_t Add(unsigned delay, uint64_t serial, uint64_t cookie);
+
+	// Does nothing for timers that already expired.
+	void Cancel(uint64_t id);
+
+	size_t Size() const { return fSlotOf.size(); }
+
+private:
+	enum {
+		kTick = 10,        // ms
+		kSlots = 512       // one turn of the wheel is kSlots * kTick ms
+	};
+
+	struct Entry {
+		uint64_t fId;
+		uint64_t fSerial;
+		uint64_t fCookie;
+		uint64_t fExpires;  // uv_now()
+	};
+
+	explicit LS2TimerWheel(v8::Isolate* isolate);
+	~LS2TimerWheel();
+
+	static void TimerCallback(uv_timer_t* timer);
+	static void CloseCallback(uv_handle_t* handle);
+	static void CleanupHook(void* arg);
+
+	void Expire();
+
+	// prevent copying
+	LS2TimerWheel( const LS2TimerWheel& );
+	const LS2TimerWheel& operator=( const LS2TimerWheel& );
+
+	uv_loop_t* fLoop;
+	uv_timer_t* fTimer;
+	std::vector<std::vector<Entry> > fSlots;
+	std::unordered_map<uint64_t, unsigned> fSlotOf;  // slot of each pending timer, by id
+	uint64_t fNow;       // uv_now() of the tick fCurrent stands for
+	unsigned fCurrent;   // slot of fNow
+	uint64_t fNextId;
+};
+
+#endif
@@ -94,6 +94,24 @@ template <> struct ConvertFromJS<int> {
 	int fValue;
 };
 
+template <> struct ConvertFromJS<bool> {
+	explicit ConvertFromJS(const v8::Local<v8::Value>& value) : fValue(value->BooleanValue(v8::Isolate::GetCurrent())) {}
+	bool value() const {
+		return fValue;
+	}
+
+	bool fValue;
+};
+
+template <> struct ConvertFromJS< v8::Local<v8::Value> > {
+	explicit ConvertFromJS(const v8::Local<v8::Value>& value) : fValue(value) {}
+	v8::Local<v8::Value> value() const {
+		return fValue;
+	}
+
+	v8::Local<v8::Value> fValue;
+};
+
 // Include the generated templates. If we had C++0x we could use variadic templates instead.
 #include "node_ls2_member_function_wrappers.h"
 
@@ -56,29 +56,60 @@ function dieCallback (message) {
     _.delay(process.exit, 1);
 }
 
+// Answers after a second, to keep the admission slot busy
+function slowCallback (message) {
+    sys.log("slowCallback: " + JSON.stringify(h.getAdmissionStats()));
+    _.delay(function() {
+        message.respondJSON({returnValue: true, msg: "slow"});
+    }, 1000);
+}
+
+// Counts the calls that reach the service, to show the cached and coalesced ones
+var countCalls = 0;
+function countCallback (message) {
+    countCalls++;
+    var r = {returnValue: true, count: countCalls, params: message.payloadJSON()};
+    _.delay(function() {
+        message.respondJSON(r);
+    }, 200);
+}
+
+// Sends a burst of updates, for the queue of a paused subscription
+function streamCallback (message) {
+    for (var i = 0; i < 5; i++) {
+        message.respondJSON({returnValue: true, seq: i});
+    }
+}
+
+// Never answers, for the call deadlines
+function neverCallback (message) {
+    sys.log("neverCallback: not answering");
+}
+
+// Methods registered without a handler still emit 'request'
 function requestArrived(message) {
     sys.log("requestArrived");
     message.print();
-    switch(message.method()) {
-    case "test":
-        testCallback(message);
-        break;
-    case "delay":
-        delayCallback(message);
-        break;
-    case "die":
-        dieCallback(message);
-        break;
-    case "error":
-        errorCallback(message);
-        break;
+    if (message.method() == "echo") {
+        message.respond(message.payload());
     }
 }
 
 h = new pb.Handle("com.webos.node_js_service", false);
-h.registerMethod("", "test")
-h.registerMethod("", "delay")
-h.registerMethod("", "die")
-h.registerMethod("", "error")
+h.registerMethod("", "test", testCallback)
+h.registerMethod("", "delay", delayCallback)
+h.registerMethod("", "die", dieCallback)
+h.registerMethod("", "error", errorCallback)
+h.registerMethods("", {
+    slow: slowCallback,
+    count: countCallback,
+    stream: streamCallback,
+    never: neverCallback,
+    echo: null
+});
+
+// One request of slow at a time, one more waits up to half a second and the
+// rest are shed with the busy response
+h.setAdmissionLimit("", "slow", {maxConcurrent: 1, maxQueued: 1, maxWait: 500, errorText: "Too slow"});
 
 h.addListener('request', requestArrived);
@@ -49,3 +49,82 @@ call.setResponseTimeout(1000*(d+3));
 
 var call = h.subscribe("palm://com.webos.node_js_service/delay", s);
 call.addListener('response', delayResponseArrived);
+
+var service = "palm://com.webos.node_js_service/";
+
+// waitForService: resolves once the service is up, rejects with a timeout error
+// for one that never comes
+h.waitForService("com.webos.node_js_service", 2000).then(function() {
+	sys.log("waitForService: up, status " + h.getServiceStatus("com.webos.node_js_service"));
+}, function(error) {
+	sys.log("waitForService failed: " + error.method);
+});
+h.waitForService("com.webos.no_such_service", 500).then(function() {
+	sys.log("waitForService: unexpectedly up");
+}, function(error) {
+	sys.log("waitForService timed out as expected: " + error.method);
+});
+
+// Method handlers, and a method without one answering through 'request'
+h.callAsync(service + "test", JSON.stringify({msg: "handler"})).then(function(payload) {
+	sys.log("handler response: " + payload);
+});
+h.callAsync(service + "echo", JSON.stringify({msg: "event"})).then(function(payload) {
+	sys.log("'request' response: " + payload);
+});
+
+// callAsync timeout: never answers, so the promise rejects with method "timeout"
+h.callAsync(service + "never", "{}", {timeout: 500}).then(function(payload) {
+	sys.log("callAsync to never: unexpected response " + payload);
+}, function(error) {
+	sys.log("callAsync to never rejected: " + error.method);
+});
+
+// Call deadline: the call ends with an error response whose method is "timeout"
+var call = h.call(service + "never", "{}", {timeoutMs: 500});
+call.addListener('response', function(message) {
+	sys.log("call to never: " + message.category() + "/" + message.method() + " " + message.payload());
+});
+
+// Cache and single flight: the second call only differs in key order, so it
+// joins the first; the third comes after it and is served from the cache. A
+// coalesced call with a shorter timeout of its own times out alone.
+h.setCallCacheTTL(service + "count", 5000);
+h.callAsync(service + "count", '{"a": 1, "b": 2}', {json: true}).then(function(r) {
+	sys.log("count first: " + r.count);
+	h.callAsync(service + "count", '{"a":1,"b":2}', {json: true}).then(function(r) {
+		sys.log("count cached: " + r.count + " " + JSON.stringify(h.getCallCacheStats()));
+	});
+});
+h.callAsync(service + "count", '{"b":2,"a":1}', {json: true}).then(function(r) {
+	sys.log("count coalesced: " + r.count);
+});
+h.callAsync(service + "count", '{"a":1,"b":2}', {timeout: 50}).then(function(r) {
+	sys.log("count short timeout: unexpected response " + r);
+}, function(error) {
+	sys.log("count short timeout rejected: " + error.method);
+});
+
+// Admission: one slow request runs, one waits and expires after maxWait, the
+// others are shed with the busy response
+for (var i = 0; i < 4; i++) {
+	h.callAsync(service + "slow", "{}", {json: true}).then(function(r) {
+		sys.log("slow: " + JSON.stringify(r));
+	});
+}
+
+// Pause, queue limit and pull: the burst arrives while paused, only the two
+// newest are kept, one is pulled and the other comes with resume
+var stream = h.subscribe(service + "stream", "{}");
+stream.pause();
+stream.setQueueLimit(2, "dropOldest");
+stream.addListener('response', function(message) {
+	sys.log("stream: " + message.payload());
+});
+_.delay(function() {
+	sys.log("stream queue: " + JSON.stringify(stream.getQueueStats()));
+	sys.log("stream pulled " + stream.pull(1));
+	stream.resume();
+	sys.log("stream queue after resume: " + JSON.stringify(stream.getQueueStats()));
+	stream.cancel();
+}, 1000);